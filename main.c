@@ -1,63 +1,308 @@
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <float.h>
+#include <limits.h>
+#include <strings.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
+#ifdef SEAMCARVE_NO_MAIN
+// The library carries a private copy of stb, so it links next to an embedder's own stb of any
+// version. Most of it goes unused here.
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_STATIC
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
 #include "stb_image.h"
 #include "stb_image_write.h"
+#ifdef SEAMCARVE_NO_MAIN
+#pragma GCC diagnostic pop
+#endif
+#ifndef SEAMCARVE_NO_MAIN
 #define NOB_IMPLEMENTATION
+#endif
 #include "nob.h"
+#include "seamcarve.h"
 
+// When offset is not NULL, row y starts offset[y] items into its stride. Seam removal
+// shifts whichever side of the seam is shorter and moves the start of the row when it
+// shifts the left one.
+#define ROW_OFFSET(offset, row) ((offset) != NULL ? (offset)[row] : 0)
+
+// When index is not NULL the image is carved lazily: the columns are only removed from the
+// per row map of original column indices and the pixels stay where they were until
+// img_materialize.
 typedef struct {
     uint32_t *pixels;
+    uint16_t *index;
+    int *offset;
     int width, height, stride;
 } Img;
 
-#define IMG_AT(img, row, col) (img).pixels[(row)*(img).stride + (col)]
+#define IMG_COLUMN(img, row, col) \
+    ((img).index != NULL \
+        ? (img).index[(size_t)(row)*(img).stride + ROW_OFFSET((img).offset, row) + (col)] \
+        : ROW_OFFSET((img).offset, row) + (col))
+#define IMG_AT(img, row, col) (img).pixels[(size_t)(row)*(img).stride + IMG_COLUMN(img, row, col)]
 
 typedef struct {
     float *items;
+    int *offset;
     int width, height, stride;
 } Mat;
 
-#define MAT_AT(mat, row, col) (mat).items[(row)*(mat).stride + (col)]
+#define MAT_AT(mat, row, col) (mat).items[(size_t)(row)*(mat).stride + ROW_OFFSET((mat).offset, row) + (col)]
 #define MAT_WITHIN(mat, row, col) \
     (0 <= (col) && (col) < (mat).width && 0 <= (row) && (row) < (mat).height)
 
+// Array of structures layout of everything the carving loop needs per pixel, so removing a
+// seam is a single memmove per row
+typedef struct {
+    uint32_t pixel;
+    float lum;
+    float grad;
+} Cell;
+
+typedef struct {
+    Cell *items;
+    int *offset;
+    int width, height, stride;
+} Cells;
+
+#define CELLS_AT(cells, row, col) (cells).items[(size_t)(row)*(cells).stride + ROW_OFFSET((cells).offset, row) + (col)]
+
+// The direction the seam takes from every cell of dp to the row above, packed as two bit
+// planes per row: a set bit in the left plane means x - 1, a set bit in the right plane
+// means x + 1 and neither means x. stride is the size of one plane in bytes.
+typedef struct {
+    uint8_t *bits;
+    int width, height, stride;
+} Dirs;
+
+#define DIRS_LEFT(dirs, row) (&(dirs).bits[(size_t)(row)*2*(dirs).stride])
+#define DIRS_RIGHT(dirs, row) (DIRS_LEFT(dirs, row) + (dirs).stride)
+#define DIRS_AT(dirs, row, col) \
+    ((DIRS_RIGHT(dirs, row)[(col)/8] >> ((col)%8) & 1) - (DIRS_LEFT(dirs, row)[(col)/8] >> ((col)%8) & 1))
+
+// When scratch_dir is set the planes that grow with the image live in memory mapped scratch
+// files in it instead of RAM, so the kernel can page them out and carve images larger than
+// the memory. Every pass walks the planes row by row, which keeps the disk access sequential.
+static const char *scratch_dir = NULL;
+
+// A bump allocator for everything a carve needs. What does not fit into the block is
+// allocated on its own, and the next reset grows the block to fit the carve, so from then on
+// carves of the same size or smaller only bump.
+typedef struct {
+    char *base;
+    size_t capacity;
+    size_t used; // bumped so far in base
+    size_t demand; // everything allocated since the reset, in base or not
+    size_t last_demand; // the demand right before the last reset
+    size_t high_water; // the biggest demand between two resets
+    struct {
+        void **items;
+        size_t count;
+        size_t capacity;
+    } overflow;
+} Arena;
+
+// Aligned for the widest vector loads
+#define ARENA_ALIGN 64
+
+static void *arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1)/ARENA_ALIGN*ARENA_ALIGN;
+    arena->demand += size;
+    if (arena->demand > arena->high_water) arena->high_water = arena->demand;
+    if (arena->used + size <= arena->capacity) {
+        void *items = arena->base + arena->used;
+        arena->used += size;
+        return items;
+    }
+    void *items = aligned_alloc(ARENA_ALIGN, size);
+    assert(items != NULL);
+    nob_da_append(&arena->overflow, items);
+    return items;
+}
+
+static void arena_reset(Arena *arena)
+{
+    for (size_t i = 0; i < arena->overflow.count; ++i) free(arena->overflow.items[i]);
+    arena->overflow.count = 0;
+    if (arena->capacity < arena->demand) {
+        free(arena->base);
+        arena->base = aligned_alloc(ARENA_ALIGN, arena->demand);
+        assert(arena->base != NULL);
+        arena->capacity = arena->demand;
+    }
+    arena->used = 0;
+    arena->last_demand = arena->demand;
+    arena->demand = 0;
+}
+
+static void arena_destroy(Arena *arena)
+{
+    arena_reset(arena);
+    free(arena->base);
+    free(arena->overflow.items);
+    memset(arena, 0, sizeof(*arena));
+}
+
+// While a thread has an arena, all of its allocations come out of it and freeing them does
+// nothing, the arena gets them all back on reset
+static _Thread_local Arena *storage_arena = NULL;
+
+// A mapping keeps its size in front of the items, aligned for the widest vector loads
+#define STORAGE_HEADER 64
+
+static void *storage_alloc(size_t size)
+{
+    if (storage_arena != NULL) return arena_alloc(storage_arena, size);
+    if (scratch_dir == NULL) {
+        void *items = malloc(size);
+        assert(items != NULL);
+        return items;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/seam-carving-XXXXXX", scratch_dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not create a scratch file in %s: %s\n", scratch_dir, strerror(errno));
+        exit(1);
+    }
+    // The file lives exactly as long as the mapping
+    unlink(path);
+    size_t total = STORAGE_HEADER + size;
+    if (ftruncate(fd, total) < 0) {
+        fprintf(stderr, "ERROR: could not grow a scratch file in %s to %zu bytes: %s\n", scratch_dir, total, strerror(errno));
+        exit(1);
+    }
+    char *base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map a scratch file of %zu bytes: %s\n", total, strerror(errno));
+        exit(1);
+    }
+    madvise(base, total, MADV_SEQUENTIAL);
+    memcpy(base, &total, sizeof(total));
+    return base + STORAGE_HEADER;
+}
+
+static void storage_free(void *items)
+{
+    if (items == NULL || storage_arena != NULL) return;
+    if (scratch_dir == NULL) {
+        free(items);
+        return;
+    }
+    char *base = (char*)items - STORAGE_HEADER;
+    size_t total;
+    memcpy(&total, base, sizeof(total));
+    munmap(base, total);
+}
+
+// The small buffers are not worth a scratch file of their own, but still come out of the arena
+static void *heap_alloc(size_t size)
+{
+    if (storage_arena != NULL) return arena_alloc(storage_arena, size);
+    void *items = malloc(size);
+    assert(items != NULL);
+    return items;
+}
+
+static void *heap_calloc(size_t count, size_t size)
+{
+    void *items = heap_alloc(count*size);
+    memset(items, 0, count*size);
+    return items;
+}
+
+static void heap_free(void *items)
+{
+    if (storage_arena == NULL) free(items);
+}
+
+static Dirs dirs_alloc(int width, int height)
+{
+    Dirs dirs = {0};
+    dirs.stride = (width + 7)/8;
+    dirs.bits = storage_alloc((size_t)2*dirs.stride*height);
+    dirs.width = width;
+    dirs.height = height;
+    return dirs;
+}
+
 static Mat mat_alloc(int width, int height)
 {
     Mat mat = {0};
-    mat.items = malloc(sizeof(float)*width*height);
-    assert(mat.items != NULL);
+    mat.items = storage_alloc(sizeof(float)*width*height);
     mat.width = width;
     mat.height = height;
     mat.stride = width;
     return mat;
 }
 
-// https://stackoverflow.com/questions/596216/formula-to-determine-perceived-brightness-of-rgb-color
-static float rgb_to_lum(uint32_t rgb)
+typedef enum {
+    // Bit identical to rgb_to_lum
+    LUM_EXACT,
+    // Integer weights, within 2e-5 of rgb_to_lum
+    LUM_FIXED,
+} Lum;
+
+// Converts n pixels to luminance
+typedef void (*Lum_Span)(const uint32_t *pixels, float *out, int n);
+
+// rgb_to_lum with the division and the multiplication of every channel folded into a table.
+// The channels are still added up in double in the same order, so the result is the same.
+static double lum_lut[3][256];
+static pthread_once_t lum_lut_once = PTHREAD_ONCE_INIT;
+
+static void lum_lut_init(void)
 {
-    float r = ((rgb >> (8*0)) & 0xFF)/255.0;
-    float g = ((rgb >> (8*1)) & 0xFF)/255.0;
-    float b = ((rgb >> (8*2)) & 0xFF)/255.0;
-    return 0.2126*r + 0.7152*g + 0.0722*b;
+    for (int i = 0; i < 256; ++i) {
+        lum_lut[0][i] = 0.2126*(float)(i/255.0);
+        lum_lut[1][i] = 0.7152*(float)(i/255.0);
+        lum_lut[2][i] = 0.0722*(float)(i/255.0);
+    }
 }
 
-static void luminance(Img img, Mat lum)
+static void lum_exact_scalar(const uint32_t *pixels, float *out, int n)
 {
-    assert(img.width == lum.width);
-    assert(img.height == lum.height);
-    for (int y = 0; y < lum.height; ++y) {
-        for (int x = 0; x < lum.width; ++x) {
-            MAT_AT(lum, y, x) = rgb_to_lum(IMG_AT(img, y, x));
-        }
+    for (int i = 0; i < n; ++i) {
+        uint32_t rgb = pixels[i];
+        out[i] = lum_lut[0][(rgb >> (8*0)) & 0xFF] + lum_lut[1][(rgb >> (8*1)) & 0xFF] + lum_lut[2][(rgb >> (8*2)) & 0xFF];
     }
 }
 
-static float sobel_filter_at(Mat mat, int cx, int cy)
+// The weights scaled by 2^15 so they fit into signed 16 bit lanes. They add up to exactly
+// 1 << 15, so the weighted sum stays below 2^24 and converts to float without rounding.
+#define LUM_FIXED_R 6966
+#define LUM_FIXED_G 23436
+#define LUM_FIXED_B 2366
+#define LUM_FIXED_SCALE (1.0f/(255.0f*32768.0f))
+
+static void lum_fixed_scalar(const uint32_t *pixels, float *out, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        uint32_t rgb = pixels[i];
+        int32_t sum = LUM_FIXED_R*((rgb >> (8*0)) & 0xFF) + LUM_FIXED_G*((rgb >> (8*1)) & 0xFF) + LUM_FIXED_B*((rgb >> (8*2)) & 0xFF);
+        out[i] = (float)sum*LUM_FIXED_SCALE;
+    }
+}
+
+static float sobel(float c[3][3])
 {
     static float gx[3][3] = {
         {1.0, 0.0, -1.0},
@@ -73,13 +318,10 @@ static float sobel_filter_at(Mat mat, int cx, int cy)
 
     float sx = 0.0;
     float sy = 0.0;
-    for (int dy = -1; dy <= 1; ++dy) {
-        for (int dx = -1; dx <= 1; ++dx) {
-            int x = cx + dx;
-            int y = cy + dy;
-            float c = MAT_WITHIN(mat, y, x) ? MAT_AT(mat, y, x) : 0.0;
-            sx += c*gx[dy + 1][dx + 1];
-            sy += c*gy[dy + 1][dx + 1];
+    for (int dy = 0; dy < 3; ++dy) {
+        for (int dx = 0; dx < 3; ++dx) {
+            sx += c[dy][dx]*gx[dy][dx];
+            sy += c[dy][dx]*gy[dy][dx];
         }
     }
     // NOTE: Apparently sqrtf does not make that much difference perceptually.
@@ -88,166 +330,3763 @@ static float sobel_filter_at(Mat mat, int cx, int cy)
     return sx*sx + sy*sy;
 }
 
-static void sobel_filter(Mat mat, Mat grad)
+// The e1 energy, the absolute differences of the direct neighbours
+static float e1(float c[3][3])
 {
-    assert(mat.width == grad.width);
-    assert(mat.height == grad.height);
+    return fabsf(c[1][2] - c[1][0]) + fabsf(c[2][1] - c[0][1]);
+}
+
+// sobel() with the Scharr weights, which respond the same to edges in every direction
+static float scharr(float c[3][3])
+{
+    static float gx[3][3] = {
+        {3.0, 0.0, -3.0},
+        {10.0, 0.0, -10.0},
+        {3.0, 0.0, -3.0},
+    };
+
+    static float gy[3][3] = {
+        {3.0, 10.0, 3.0},
+        {0.0, 0.0, 0.0},
+        {-3.0, -10.0, -3.0},
+    };
 
-    for (int cy = 0; cy < mat.height; ++cy) {
-        for (int cx = 0; cx < mat.width; ++cx) {
-            MAT_AT(grad, cy, cx) = sobel_filter_at(mat, cx, cy);
+    float sx = 0.0;
+    float sy = 0.0;
+    for (int dy = 0; dy < 3; ++dy) {
+        for (int dx = 0; dx < 3; ++dx) {
+            sx += c[dy][dx]*gx[dy][dx];
+            sy += c[dy][dx]*gy[dy][dx];
         }
     }
+    return sx*sx + sy*sy;
 }
 
-static void grad_to_dp(Mat grad, Mat dp)
-{
-    assert(grad.width == dp.width);
-    assert(grad.height == dp.height);
+// An energy of the 3x3 neighbourhood of a cell
+typedef float (*Stencil)(float c[3][3]);
 
-    for (int x = 0; x < grad.width; ++x) {
-        MAT_AT(dp, 0, x) = MAT_AT(grad, 0, x);
+// The energies the seams can be searched on. The first three are stencils over the lum plane.
+// The half resolution energy is the sobel energy of lum averaged over 2x2 blocks, shared by
+// the four cells of every block.
+typedef enum {
+    ENERGY_SOBEL,
+    ENERGY_E1,
+    ENERGY_SCHARR,
+    ENERGY_HALF,
+} Energy;
+
+static Stencil energy_stencil(Energy energy)
+{
+    switch (energy) {
+    case ENERGY_E1: return e1;
+    case ENERGY_SCHARR: return scharr;
+    default: return sobel;
     }
-    for (int y = 1; y < grad.height; ++y) {
-        for (int cx = 0; cx < grad.width; ++cx) {
-            float m = FLT_MAX;
-            for (int dx = -1; dx <= 1; ++dx) {
-                int x = cx + dx;
-                float value = 0 <= x && x < grad.width ? MAT_AT(dp, y - 1, x) : FLT_MAX;
-                if (value < m) m = value;
-            }
-            MAT_AT(dp, y, cx) = MAT_AT(grad, y, cx) + m;
+}
+
+// How far from a cell the pixels that its energy depends on can be
+static int energy_reach(Energy energy)
+{
+    return energy == ENERGY_HALF ? 3 : 1;
+}
+
+// Computes the cells [x0, x1) of a grad row from three rows of lum with one of the stencils.
+// All the rows are indexed by the absolute column and the span reads one cell past both of its
+// ends, so the caller has to make sure those exist.
+typedef void (*Stencil_Span)(const float *up, const float *mid, const float *down, float *out, int x0, int x1);
+
+static inline float stencil_cell(Stencil stencil, const float *up, const float *mid, const float *down, int cx)
+{
+    float c[3][3] = {
+        {up[cx - 1], up[cx], up[cx + 1]},
+        {mid[cx - 1], mid[cx], mid[cx + 1]},
+        {down[cx - 1], down[cx], down[cx + 1]},
+    };
+    return stencil(c);
+}
+
+// A cell on the left or the right edge of a row of the given width sees zeros past the edge
+static float stencil_edge_cell(Stencil stencil, const float *up, const float *mid, const float *down, int cx, int width)
+{
+    const float *rows[3] = {up, mid, down};
+    float c[3][3];
+    for (int dy = 0; dy < 3; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            int x = cx + dx;
+            c[dy][dx + 1] = 0 <= x && x < width ? rows[dy][x] : 0.0;
         }
     }
+    return stencil(c);
 }
 
-static void usage(const char *program)
+static void sobel_span_scalar(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
 {
-    fprintf(stderr, "Usage: %s <input> <output>\n", program);
+    for (int cx = x0; cx < x1; ++cx) {
+        out[cx] = stencil_cell(sobel, up, mid, down, cx);
+    }
 }
 
-static void img_remove_column_at_row(Img img, int row, int column)
+static void e1_span_scalar(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
 {
-    uint32_t *pixel_row = &IMG_AT(img, row, 0);
-    memmove(pixel_row + column, pixel_row + column + 1, (img.width - column - 1)*sizeof(uint32_t));
+    for (int cx = x0; cx < x1; ++cx) {
+        out[cx] = stencil_cell(e1, up, mid, down, cx);
+    }
 }
 
-static void mat_remove_column_at_row(Mat mat, int row, int column)
+static void scharr_span_scalar(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
 {
-    float *pixel_row = &MAT_AT(mat, row, 0);
-    memmove(pixel_row + column, pixel_row + column + 1, (mat.width - column - 1)*sizeof(float));
+    for (int cx = x0; cx < x1; ++cx) {
+        out[cx] = stencil_cell(scharr, up, mid, down, cx);
+    }
 }
 
-static void compute_seam(Mat dp, int *seam)
+// Forward energy charges a seam for the edges it creates between the pixels that become
+// neighbours once it is removed, instead of for the pixels it removes. up and mid are the lum
+// rows y - 1 and y, and the span computes the cells [x0, x1) of dp row y from prev like
+// Stencil_Span, reading one cell past both of its ends.
+typedef void (*Forward_Span)(const float *prev, const float *up, const float *mid, float *out, int x0, int x1);
+
+// The three step costs, the order of the operations is the same in every kernel
+#define FORWARD_COSTS(left, right, top, cu, cl, cr) \
+    do {                                            \
+        cu = fabsf(right - left);                   \
+        cl = cu + fabsf(top - left);                \
+        cr = cu + fabsf(top - right);               \
+    } while (0)
+
+static float forward_cell(const float *prev, const float *up, const float *mid, int cx)
 {
-    int y = dp.height - 1;
-    seam[y] = 0;
-    for (int x = 1; x < dp.width; ++x) {
-        if (MAT_AT(dp, y, x) < MAT_AT(dp, y, seam[y])) {
-            seam[y] = x;
-        }
+    float cu, cl, cr;
+    FORWARD_COSTS(mid[cx - 1], mid[cx + 1], up[cx], cu, cl, cr);
+    float m = prev[cx] + cu;
+    if (prev[cx - 1] + cl < m) m = prev[cx - 1] + cl;
+    if (prev[cx + 1] + cr < m) m = prev[cx + 1] + cr;
+    return m;
+}
+
+// On the edges the missing neighbour is replaced by the pixel itself and the step that would
+// leave the row is not taken
+static float forward_edge_cell(const float *prev, const float *up, const float *mid, int cx, int width)
+{
+    float cu, cl, cr;
+    FORWARD_COSTS(mid[cx > 0 ? cx - 1 : cx], mid[cx + 1 < width ? cx + 1 : cx], up[cx], cu, cl, cr);
+    float m = prev[cx] + cu;
+    if (cx > 0 && prev[cx - 1] + cl < m) m = prev[cx - 1] + cl;
+    if (cx + 1 < width && prev[cx + 1] + cr < m) m = prev[cx + 1] + cr;
+    return m;
+}
+
+static void forward_span_scalar(const float *prev, const float *up, const float *mid, float *out, int x0, int x1)
+{
+    for (int cx = x0; cx < x1; ++cx) {
+        out[cx] = forward_cell(prev, up, mid, cx);
     }
+}
 
-    for (y = dp.height - 2; y >= 0; --y) {
-        seam[y] = seam[y+1];
-        for (int dx = -1; dx <= 1; ++dx) {
-            int x = seam[y+1] + dx;
-            if (0 <= x && x < dp.width && MAT_AT(dp, y, x) < MAT_AT(dp, y, seam[y])) {
-                seam[y] = x;
-            }
+// Computes the cells [x0, x1) of a dp row from the previous dp row and the gradient row. All
+// three rows are indexed by the absolute column and width is the width of the row.
+typedef void (*Dp_Row)(const float *prev, const float *grad, float *out, int x0, int x1, int width);
+
+static float dp_cell(const float *prev, const float *grad, int cx, int width)
+{
+    float m = FLT_MAX;
+    for (int dx = -1; dx <= 1; ++dx) {
+        int x = cx + dx;
+        float value = 0 <= x && x < width ? prev[x] : FLT_MAX;
+        if (value < m) m = value;
+    }
+    return grad[cx] + m;
+}
+
+static void dp_row_scalar(const float *prev, const float *grad, float *out, int x0, int x1, int width)
+{
+    for (int cx = x0; cx < x1; ++cx) {
+        out[cx] = dp_cell(prev, grad, cx, width);
+    }
+}
+
+// Same as Dp_Row, but also records the directions of the cells [x0, x1) into the bit planes
+// of the row. x0 must be a multiple of 8 and the kernel writes whole bytes of the planes.
+typedef void (*Dp_Dirs_Row)(const float *prev, const float *grad, float *out, uint8_t *left, uint8_t *right, int x0, int x1, int width);
+
+// Ties are resolved exactly like compute_seam does: the cell right above wins, then the
+// one on the left.
+static float dp_dirs_cell(const float *prev, const float *grad, int cx, int width, int *dir)
+{
+    float m = prev[cx];
+    *dir = 0;
+    if (cx > 0 && prev[cx - 1] < m) {
+        m = prev[cx - 1];
+        *dir = -1;
+    }
+    if (cx + 1 < width && prev[cx + 1] < m) {
+        m = prev[cx + 1];
+        *dir = 1;
+    }
+    return grad[cx] + m;
+}
+
+// Handles the cells [gx, min(gx + 8, x1)) of the byte that starts at gx
+static void dp_dirs_byte(const float *prev, const float *grad, float *out, uint8_t *left, uint8_t *right, int gx, int x1, int width)
+{
+    uint8_t l = 0, r = 0;
+    for (int i = 0; i < 8 && gx + i < x1; ++i) {
+        int dir;
+        out[gx + i] = dp_dirs_cell(prev, grad, gx + i, width, &dir);
+        if (dir < 0) l |= 1 << i;
+        if (dir > 0) r |= 1 << i;
+    }
+    left[gx/8] = l;
+    right[gx/8] = r;
+}
+
+static void dp_dirs_row_scalar(const float *prev, const float *grad, float *out, uint8_t *left, uint8_t *right, int x0, int x1, int width)
+{
+    assert(x0%8 == 0);
+    for (int gx = x0; gx < x1; gx += 8) {
+        dp_dirs_byte(prev, grad, out, left, right, gx, x1, width);
+    }
+}
+
+// The vector kernels only handle the cells [*begin, *end) that have both neighbours inside
+// the row. The first and the last cell of the row go through dp_cell which takes care of the
+// FLT_MAX edges. min is exact, so all the kernels produce bit identical results.
+static void dp_row_interior(int x0, int x1, int width, int *begin, int *end)
+{
+    *begin = x0 > 1 ? x0 : 1;
+    *end = x1 < width - 1 ? x1 : width - 1;
+    if (*begin > *end) *begin = *end = x1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+
+__attribute__((target("sse2")))
+static void dp_row_sse2(const float *prev, const float *grad, float *out, int x0, int x1, int width)
+{
+    int begin, end;
+    dp_row_interior(x0, x1, width, &begin, &end);
+    for (int cx = x0; cx < begin; ++cx) out[cx] = dp_cell(prev, grad, cx, width);
+    int cx = begin;
+    for (; cx + 4 <= end; cx += 4) {
+        __m128 m = _mm_min_ps(_mm_loadu_ps(prev + cx - 1), _mm_loadu_ps(prev + cx));
+        m = _mm_min_ps(m, _mm_loadu_ps(prev + cx + 1));
+        _mm_storeu_ps(out + cx, _mm_add_ps(_mm_loadu_ps(grad + cx), m));
+    }
+    for (; cx < x1; ++cx) out[cx] = dp_cell(prev, grad, cx, width);
+}
+
+__attribute__((target("avx2")))
+static void dp_row_avx2(const float *prev, const float *grad, float *out, int x0, int x1, int width)
+{
+    int begin, end;
+    dp_row_interior(x0, x1, width, &begin, &end);
+    for (int cx = x0; cx < begin; ++cx) out[cx] = dp_cell(prev, grad, cx, width);
+    int cx = begin;
+    for (; cx + 8 <= end; cx += 8) {
+        __m256 m = _mm256_min_ps(_mm256_loadu_ps(prev + cx - 1), _mm256_loadu_ps(prev + cx));
+        m = _mm256_min_ps(m, _mm256_loadu_ps(prev + cx + 1));
+        _mm256_storeu_ps(out + cx, _mm256_add_ps(_mm256_loadu_ps(grad + cx), m));
+    }
+    for (; cx < x1; ++cx) out[cx] = dp_cell(prev, grad, cx, width);
+}
+
+__attribute__((target("avx512f")))
+static void dp_row_avx512(const float *prev, const float *grad, float *out, int x0, int x1, int width)
+{
+    int begin, end;
+    dp_row_interior(x0, x1, width, &begin, &end);
+    for (int cx = x0; cx < begin; ++cx) out[cx] = dp_cell(prev, grad, cx, width);
+    int cx = begin;
+    for (; cx + 16 <= end; cx += 16) {
+        __m512 m = _mm512_min_ps(_mm512_loadu_ps(prev + cx - 1), _mm512_loadu_ps(prev + cx));
+        m = _mm512_min_ps(m, _mm512_loadu_ps(prev + cx + 1));
+        _mm512_storeu_ps(out + cx, _mm512_add_ps(_mm512_loadu_ps(grad + cx), m));
+    }
+    if (cx < end) {
+        __mmask16 k = (__mmask16)((1u << (end - cx)) - 1);
+        __m512 m = _mm512_min_ps(_mm512_maskz_loadu_ps(k, prev + cx - 1), _mm512_maskz_loadu_ps(k, prev + cx));
+        m = _mm512_min_ps(m, _mm512_maskz_loadu_ps(k, prev + cx + 1));
+        _mm512_mask_storeu_ps(out + cx, k, _mm512_add_ps(_mm512_maskz_loadu_ps(k, grad + cx), m));
+        cx = end;
+    }
+    for (; cx < x1; ++cx) out[cx] = dp_cell(prev, grad, cx, width);
+}
+
+// The direction kernels go a byte of the bit planes at a time. min(a, b) is a < b ? a : b,
+// which is exactly the tie breaking of dp_dirs_cell.
+__attribute__((target("sse2")))
+static void dp_dirs_row_sse2(const float *prev, const float *grad, float *out, uint8_t *left, uint8_t *right, int x0, int x1, int width)
+{
+    assert(x0%8 == 0);
+    for (int gx = x0; gx < x1; gx += 8) {
+        if (gx < 1 || gx + 8 > x1 || gx + 8 > width - 1) {
+            dp_dirs_byte(prev, grad, out, left, right, gx, x1, width);
+            continue;
         }
+        int l = 0, r = 0;
+        for (int h = 0; h < 8; h += 4) {
+            int cx = gx + h;
+            __m128 a = _mm_loadu_ps(prev + cx - 1);
+            __m128 c = _mm_loadu_ps(prev + cx);
+            __m128 b = _mm_loadu_ps(prev + cx + 1);
+            __m128 lt = _mm_cmplt_ps(a, c);
+            __m128 m = _mm_min_ps(a, c);
+            __m128 rt = _mm_cmplt_ps(b, m);
+            m = _mm_min_ps(b, m);
+            _mm_storeu_ps(out + cx, _mm_add_ps(_mm_loadu_ps(grad + cx), m));
+            l |= _mm_movemask_ps(_mm_andnot_ps(rt, lt)) << h;
+            r |= _mm_movemask_ps(rt) << h;
+        }
+        left[gx/8] = l;
+        right[gx/8] = r;
     }
 }
 
-void markout_sobel_patches(Mat grad, int *seam)
+__attribute__((target("avx2")))
+static void dp_dirs_row_avx2(const float *prev, const float *grad, float *out, uint8_t *left, uint8_t *right, int x0, int x1, int width)
 {
-    for (int cy = 0; cy < grad.height; ++cy) {
-        int cx = seam[cy];
-        for (int dy = -1; dy <= 1; ++dy) {
-            for (int dx = -1; dx <= 1; ++dx) {
-                int x = cx + dx;
-                int y = cy + dy;
-                if (MAT_WITHIN(grad, y, x)) {
-                    *(uint32_t*)&MAT_AT(grad, y, x) = 0xFFFFFFFF;
-                }
-            }
+    assert(x0%8 == 0);
+    for (int gx = x0; gx < x1; gx += 8) {
+        if (gx < 1 || gx + 8 > x1 || gx + 8 > width - 1) {
+            dp_dirs_byte(prev, grad, out, left, right, gx, x1, width);
+            continue;
         }
+        __m256 a = _mm256_loadu_ps(prev + gx - 1);
+        __m256 c = _mm256_loadu_ps(prev + gx);
+        __m256 b = _mm256_loadu_ps(prev + gx + 1);
+        __m256 lt = _mm256_cmp_ps(a, c, _CMP_LT_OQ);
+        __m256 m = _mm256_min_ps(a, c);
+        __m256 rt = _mm256_cmp_ps(b, m, _CMP_LT_OQ);
+        m = _mm256_min_ps(b, m);
+        _mm256_storeu_ps(out + gx, _mm256_add_ps(_mm256_loadu_ps(grad + gx), m));
+        left[gx/8] = _mm256_movemask_ps(_mm256_andnot_ps(rt, lt));
+        right[gx/8] = _mm256_movemask_ps(rt);
     }
 }
 
-int main(int argc, char **argv)
+__attribute__((target("avx512f")))
+static void dp_dirs_row_avx512(const float *prev, const float *grad, float *out, uint8_t *left, uint8_t *right, int x0, int x1, int width)
 {
-    const char *program = nob_shift_args(&argc, &argv);
+    assert(x0%8 == 0);
+    int gx = x0;
+    while (gx < x1) {
+        if (gx < 1 || gx + 16 > x1 || gx + 16 > width - 1) {
+            dp_dirs_byte(prev, grad, out, left, right, gx, x1, width);
+            gx += 8;
+            continue;
+        }
+        __m512 a = _mm512_loadu_ps(prev + gx - 1);
+        __m512 c = _mm512_loadu_ps(prev + gx);
+        __m512 b = _mm512_loadu_ps(prev + gx + 1);
+        __mmask16 lt = _mm512_cmp_ps_mask(a, c, _CMP_LT_OQ);
+        __m512 m = _mm512_min_ps(a, c);
+        __mmask16 rt = _mm512_cmp_ps_mask(b, m, _CMP_LT_OQ);
+        m = _mm512_min_ps(b, m);
+        _mm512_storeu_ps(out + gx, _mm512_add_ps(_mm512_loadu_ps(grad + gx), m));
+        uint16_t l = lt & ~rt;
+        uint16_t r = rt;
+        memcpy(&left[gx/8], &l, sizeof(l));
+        memcpy(&right[gx/8], &r, sizeof(r));
+        gx += 16;
+    }
+}
 
-    if (argc <= 0) {
-        usage(program);
-        fprintf(stderr, "ERROR: no input file is provided\n");
-        return 1;
+// The sobel kernels add up the taps in the same order as sobel() does, leaving out the ones
+// multiplied by zero, which keeps them bit identical to it:
+//     sx = a - c + 2d - 2f + g - i
+//     sy = a + 2b + c - g - 2h - i
+// for the neighbourhood
+//     a b c
+//     d e f
+//     g h i
+// nob builds with -ffp-contract=off, avx512f implies FMA and nothing may be fused into one.
+#define SOBEL_SIMD(type, load, add, sub, mul, store)                          \
+    do {                                                                      \
+        type a = load(up + cx - 1), b = load(up + cx), c = load(up + cx + 1);  \
+        type d = load(mid + cx - 1), f = load(mid + cx + 1);                  \
+        type g = load(down + cx - 1), h = load(down + cx), i = load(down + cx + 1); \
+        type sx = sub(add(sub(add(sub(a, c), add(d, d)), add(f, f)), g), i); \
+        type sy = sub(sub(sub(add(add(a, add(b, b)), c), g), add(h, h)), i); \
+        store(out + cx, add(mul(sx, sx), mul(sy, sy)));                       \
+    } while (0)
+
+__attribute__((target("sse2")))
+static void sobel_span_sse2(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 4 <= x1; cx += 4) {
+        SOBEL_SIMD(__m128, _mm_loadu_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_storeu_ps);
     }
-    const char *file_path = nob_shift_args(&argc, &argv);
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(sobel, up, mid, down, cx);
+}
 
-    if (argc <= 0) {
-        usage(program);
-        fprintf(stderr, "ERROR: no output file is provided\n");
-        return 1;
+__attribute__((target("avx2")))
+static void sobel_span_avx2(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 8 <= x1; cx += 8) {
+        SOBEL_SIMD(__m256, _mm256_loadu_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_storeu_ps);
     }
-    const char *out_file_path = nob_shift_args(&argc, &argv);
+    for (; cx + 4 <= x1; cx += 4) {
+        SOBEL_SIMD(__m128, _mm_loadu_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(sobel, up, mid, down, cx);
+}
 
-    int width_, height_;
-    uint32_t *pixels_ = (uint32_t*)stbi_load(file_path, &width_, &height_, NULL, 4);
-    if (pixels_ == NULL) {
-        fprintf(stderr, "ERROR: could not read %s\n", file_path);
-        return 1;
+__attribute__((target("avx512f")))
+static void sobel_span_avx512(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 16 <= x1; cx += 16) {
+        SOBEL_SIMD(__m512, _mm512_loadu_ps, _mm512_add_ps, _mm512_sub_ps, _mm512_mul_ps, _mm512_storeu_ps);
     }
-    Img img = {
-        .pixels = pixels_,
-        .width = width_,
-        .height = height_,
-        .stride = width_,
-    };
+    for (; cx + 4 <= x1; cx += 4) {
+        SOBEL_SIMD(__m128, _mm_loadu_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(sobel, up, mid, down, cx);
+}
 
-    Mat lum = mat_alloc(width_, height_);
-    Mat grad = mat_alloc(width_, height_);
-    Mat dp = mat_alloc(width_, height_);
-    int *seam = malloc(sizeof(*seam)*height_);
+// e1 and scharr follow the order of their scalar stencils the same way
+#define E1_SIMD(type, load, sub, add, abs, store)                              \
+    do {                                                                      \
+        type b = load(up + cx), d = load(mid + cx - 1), f = load(mid + cx + 1), h = load(down + cx); \
+        store(out + cx, add(abs(sub(f, d)), abs(sub(h, b))));                \
+    } while (0)
 
-    int seams_to_remove = img.width * 2 / 3;
+#define SCHARR_SIMD(type, load, set1, add, sub, mul, store)                   \
+    do {                                                                      \
+        type w3 = set1(3.0f), w10 = set1(10.0f);                              \
+        type a = mul(load(up + cx - 1), w3), b = mul(load(up + cx), w10), c = mul(load(up + cx + 1), w3); \
+        type d = mul(load(mid + cx - 1), w10), f = mul(load(mid + cx + 1), w10); \
+        type g = mul(load(down + cx - 1), w3), h = mul(load(down + cx), w10), i = mul(load(down + cx + 1), w3); \
+        type sx = sub(add(sub(add(sub(a, c), d), f), g), i);                  \
+        type sy = sub(sub(sub(add(add(a, b), c), g), h), i);                  \
+        store(out + cx, add(mul(sx, sx), mul(sy, sy)));                       \
+    } while (0)
 
-    luminance(img, lum);
-    sobel_filter(lum, grad);
+#define ABS_SSE2(x) _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF)))
+#define ABS_AVX2(x) _mm256_and_ps(x, _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF)))
 
-    for (int i = 0; i < seams_to_remove; ++i) {
-        grad_to_dp(grad, dp);
-        compute_seam(dp, seam);
-        markout_sobel_patches(grad, seam);
+__attribute__((target("sse2")))
+static void e1_span_sse2(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 4 <= x1; cx += 4) {
+        E1_SIMD(__m128, _mm_loadu_ps, _mm_sub_ps, _mm_add_ps, ABS_SSE2, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(e1, up, mid, down, cx);
+}
 
-        for (int cy = 0; cy < img.height; ++cy) {
-            int cx = seam[cy];
-            img_remove_column_at_row(img, cy, cx);
-            mat_remove_column_at_row(lum, cy, cx);
-            mat_remove_column_at_row(grad, cy, cx);
-        }
+__attribute__((target("avx2")))
+static void e1_span_avx2(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 8 <= x1; cx += 8) {
+        E1_SIMD(__m256, _mm256_loadu_ps, _mm256_sub_ps, _mm256_add_ps, ABS_AVX2, _mm256_storeu_ps);
+    }
+    for (; cx + 4 <= x1; cx += 4) {
+        E1_SIMD(__m128, _mm_loadu_ps, _mm_sub_ps, _mm_add_ps, ABS_SSE2, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(e1, up, mid, down, cx);
+}
 
-        img.width -= 1;
-        lum.width -= 1;
-        grad.width -= 1;
-        dp.width -= 1;
+__attribute__((target("avx512f")))
+static void e1_span_avx512(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 16 <= x1; cx += 16) {
+        E1_SIMD(__m512, _mm512_loadu_ps, _mm512_sub_ps, _mm512_add_ps, _mm512_abs_ps, _mm512_storeu_ps);
+    }
+    for (; cx + 4 <= x1; cx += 4) {
+        E1_SIMD(__m128, _mm_loadu_ps, _mm_sub_ps, _mm_add_ps, ABS_SSE2, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(e1, up, mid, down, cx);
+}
 
-        for (int cy = 0; cy < grad.height; ++cy) {
-            for (int cx = seam[cy]; cx < grad.width && *(uint32_t*)&MAT_AT(grad, cy, cx) == 0xFFFFFFFF; ++cx) {
-                MAT_AT(grad, cy, cx) = sobel_filter_at(lum, cx, cy);
-            }
-            for (int cx = seam[cy] - 1; cx >= 0 && *(uint32_t*)&MAT_AT(grad, cy, cx) == 0xFFFFFFFF; --cx) {
-                MAT_AT(grad, cy, cx) = sobel_filter_at(lum, cx, cy);
-            }
-        }
+__attribute__((target("sse2")))
+static void scharr_span_sse2(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 4 <= x1; cx += 4) {
+        SCHARR_SIMD(__m128, _mm_loadu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_storeu_ps);
     }
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(scharr, up, mid, down, cx);
+}
 
-    if (!stbi_write_png(out_file_path, img.width, img.height, 4, img.pixels, img.stride*sizeof(uint32_t))) {
-        fprintf(stderr, "ERROR: could not save file %s\n", out_file_path);
-        return 1;
+__attribute__((target("avx2")))
+static void scharr_span_avx2(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 8 <= x1; cx += 8) {
+        SCHARR_SIMD(__m256, _mm256_loadu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_storeu_ps);
     }
-    printf("OK: generated %s\n", out_file_path);
+    for (; cx + 4 <= x1; cx += 4) {
+        SCHARR_SIMD(__m128, _mm_loadu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(scharr, up, mid, down, cx);
+}
 
-    return 0;
+__attribute__((target("avx512f")))
+static void scharr_span_avx512(const float *up, const float *mid, const float *down, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 16 <= x1; cx += 16) {
+        SCHARR_SIMD(__m512, _mm512_loadu_ps, _mm512_set1_ps, _mm512_add_ps, _mm512_sub_ps, _mm512_mul_ps, _mm512_storeu_ps);
+    }
+    for (; cx + 4 <= x1; cx += 4) {
+        SCHARR_SIMD(__m128, _mm_loadu_ps, _mm_set1_ps, _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = stencil_cell(scharr, up, mid, down, cx);
+}
+
+#define FORWARD_SIMD(type, load, add, sub, min, abs, store)                   \
+    do {                                                                      \
+        type left = load(mid + cx - 1), right = load(mid + cx + 1), top = load(up + cx); \
+        type cu = abs(sub(right, left));                                      \
+        type cl = add(cu, abs(sub(top, left)));                               \
+        type cr = add(cu, abs(sub(top, right)));                              \
+        type m = min(add(load(prev + cx), cu), add(load(prev + cx - 1), cl)); \
+        store(out + cx, min(m, add(load(prev + cx + 1), cr)));                \
+    } while (0)
+
+__attribute__((target("sse2")))
+static void forward_span_sse2(const float *prev, const float *up, const float *mid, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 4 <= x1; cx += 4) {
+        FORWARD_SIMD(__m128, _mm_loadu_ps, _mm_add_ps, _mm_sub_ps, _mm_min_ps, ABS_SSE2, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = forward_cell(prev, up, mid, cx);
 }
+
+__attribute__((target("avx2")))
+static void forward_span_avx2(const float *prev, const float *up, const float *mid, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 8 <= x1; cx += 8) {
+        FORWARD_SIMD(__m256, _mm256_loadu_ps, _mm256_add_ps, _mm256_sub_ps, _mm256_min_ps, ABS_AVX2, _mm256_storeu_ps);
+    }
+    for (; cx + 4 <= x1; cx += 4) {
+        FORWARD_SIMD(__m128, _mm_loadu_ps, _mm_add_ps, _mm_sub_ps, _mm_min_ps, ABS_SSE2, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = forward_cell(prev, up, mid, cx);
+}
+
+__attribute__((target("avx512f")))
+static void forward_span_avx512(const float *prev, const float *up, const float *mid, float *out, int x0, int x1)
+{
+    int cx = x0;
+    for (; cx + 16 <= x1; cx += 16) {
+        FORWARD_SIMD(__m512, _mm512_loadu_ps, _mm512_add_ps, _mm512_sub_ps, _mm512_min_ps, _mm512_abs_ps, _mm512_storeu_ps);
+    }
+    for (; cx + 4 <= x1; cx += 4) {
+        FORWARD_SIMD(__m128, _mm_loadu_ps, _mm_add_ps, _mm_sub_ps, _mm_min_ps, ABS_SSE2, _mm_storeu_ps);
+    }
+    for (; cx < x1; ++cx) out[cx] = forward_cell(prev, up, mid, cx);
+}
+
+__attribute__((target("avx2")))
+static void lum_exact_avx2(const uint32_t *pixels, float *out, int n)
+{
+    __m256i mask = _mm256_set1_epi32(0xFF);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(pixels + i));
+        __m256i r = _mm256_and_si256(p, mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 8), mask);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 16), mask);
+        for (int half = 0; half < 2; ++half) {
+            __m128i rh = half ? _mm256_extracti128_si256(r, 1) : _mm256_castsi256_si128(r);
+            __m128i gh = half ? _mm256_extracti128_si256(g, 1) : _mm256_castsi256_si128(g);
+            __m128i bh = half ? _mm256_extracti128_si256(b, 1) : _mm256_castsi256_si128(b);
+            __m256d sum = _mm256_add_pd(_mm256_i32gather_pd(lum_lut[0], rh, 8), _mm256_i32gather_pd(lum_lut[1], gh, 8));
+            sum = _mm256_add_pd(sum, _mm256_i32gather_pd(lum_lut[2], bh, 8));
+            _mm_storeu_ps(out + i + 4*half, _mm256_cvtpd_ps(sum));
+        }
+    }
+    lum_exact_scalar(pixels + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void lum_exact_avx512(const uint32_t *pixels, float *out, int n)
+{
+    __m512i mask = _mm512_set1_epi32(0xFF);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i p = _mm512_loadu_si512(pixels + i);
+        __m512i r = _mm512_and_si512(p, mask);
+        __m512i g = _mm512_and_si512(_mm512_srli_epi32(p, 8), mask);
+        __m512i b = _mm512_and_si512(_mm512_srli_epi32(p, 16), mask);
+        for (int half = 0; half < 2; ++half) {
+            __m256i rh = half ? _mm512_extracti64x4_epi64(r, 1) : _mm512_castsi512_si256(r);
+            __m256i gh = half ? _mm512_extracti64x4_epi64(g, 1) : _mm512_castsi512_si256(g);
+            __m256i bh = half ? _mm512_extracti64x4_epi64(b, 1) : _mm512_castsi512_si256(b);
+            __m512d sum = _mm512_add_pd(_mm512_i32gather_pd(rh, lum_lut[0], 8), _mm512_i32gather_pd(gh, lum_lut[1], 8));
+            sum = _mm512_add_pd(sum, _mm512_i32gather_pd(bh, lum_lut[2], 8));
+            _mm256_storeu_ps(out + i + 8*half, _mm512_cvtpd_ps(sum));
+        }
+    }
+    lum_exact_scalar(pixels + i, out + i, n - i);
+}
+
+// The channels of every pixel get widened to 16 bits and multiplied by the weights pairwise,
+// which leaves r*R + g*G and b*B next to each other. The shuffle pulls the pairs apart in
+// pixel order and one more add finishes the sum.
+__attribute__((target("sse2")))
+static void lum_fixed_sse2(const uint32_t *pixels, float *out, int n)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i weights = _mm_set_epi16(0, LUM_FIXED_B, LUM_FIXED_G, LUM_FIXED_R, 0, LUM_FIXED_B, LUM_FIXED_G, LUM_FIXED_R);
+    __m128 scale = _mm_set1_ps(LUM_FIXED_SCALE);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(pixels + i));
+        __m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(p, zero), weights));
+        __m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(p, zero), weights));
+        __m128i rg = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i b = _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(rg, b)), scale));
+    }
+    lum_fixed_scalar(pixels + i, out + i, n - i);
+}
+
+// Same as sse2, the unpacks and the shuffles stay within the 128 bit lanes so the pixels
+// come out in order
+__attribute__((target("avx2")))
+static void lum_fixed_avx2(const uint32_t *pixels, float *out, int n)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i weights = _mm256_set1_epi64x(((int64_t)LUM_FIXED_B << 32) | ((int64_t)LUM_FIXED_G << 16) | LUM_FIXED_R);
+    __m256 scale = _mm256_set1_ps(LUM_FIXED_SCALE);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(pixels + i));
+        __m256 lo = _mm256_castsi256_ps(_mm256_madd_epi16(_mm256_unpacklo_epi8(p, zero), weights));
+        __m256 hi = _mm256_castsi256_ps(_mm256_madd_epi16(_mm256_unpackhi_epi8(p, zero), weights));
+        __m256i rg = _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m256i b = _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(rg, b)), scale));
+    }
+    lum_fixed_scalar(pixels + i, out + i, n - i);
+}
+
+// 16 bit madd needs avx512bw, so the avx512 kernel sticks to 32 bit multiplies. The integer
+// sum is the same either way.
+__attribute__((target("avx512f")))
+static void lum_fixed_avx512(const uint32_t *pixels, float *out, int n)
+{
+    __m512i mask = _mm512_set1_epi32(0xFF);
+    __m512 scale = _mm512_set1_ps(LUM_FIXED_SCALE);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i p = _mm512_loadu_si512(pixels + i);
+        __m512i r = _mm512_mullo_epi32(_mm512_and_si512(p, mask), _mm512_set1_epi32(LUM_FIXED_R));
+        __m512i g = _mm512_mullo_epi32(_mm512_and_si512(_mm512_srli_epi32(p, 8), mask), _mm512_set1_epi32(LUM_FIXED_G));
+        __m512i b = _mm512_mullo_epi32(_mm512_and_si512(_mm512_srli_epi32(p, 16), mask), _mm512_set1_epi32(LUM_FIXED_B));
+        __m512i sum = _mm512_add_epi32(_mm512_add_epi32(r, g), b);
+        _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_cvtepi32_ps(sum), scale));
+    }
+    lum_fixed_scalar(pixels + i, out + i, n - i);
+}
+#endif // SIMD_X86
+
+typedef struct {
+    const char *name;
+    Dp_Row dp_row;
+    Dp_Dirs_Row dp_dirs_row;
+    Stencil_Span sobel_span;
+    Stencil_Span e1_span;
+    Stencil_Span scharr_span;
+    Lum_Span lum_exact;
+    Lum_Span lum_fixed;
+    Forward_Span forward_span;
+} Simd;
+
+static Simd simds[] = {
+    {"scalar", dp_row_scalar, dp_dirs_row_scalar, sobel_span_scalar, e1_span_scalar, scharr_span_scalar, lum_exact_scalar, lum_fixed_scalar, forward_span_scalar},
+#ifdef SIMD_X86
+    {"sse2", dp_row_sse2, dp_dirs_row_sse2, sobel_span_sse2, e1_span_sse2, scharr_span_sse2, lum_exact_scalar, lum_fixed_sse2, forward_span_sse2},
+    {"avx2", dp_row_avx2, dp_dirs_row_avx2, sobel_span_avx2, e1_span_avx2, scharr_span_avx2, lum_exact_avx2, lum_fixed_avx2, forward_span_avx2},
+    {"avx512", dp_row_avx512, dp_dirs_row_avx512, sobel_span_avx512, e1_span_avx512, scharr_span_avx512, lum_exact_avx512, lum_fixed_avx512, forward_span_avx512},
+#endif
+};
+
+static Simd simd = {"scalar", dp_row_scalar, dp_dirs_row_scalar, sobel_span_scalar, e1_span_scalar, scharr_span_scalar, lum_exact_scalar, lum_fixed_scalar, forward_span_scalar};
+
+static bool simd_supported(const char *name)
+{
+    if (strcmp(name, "scalar") == 0) return true;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+    if (strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "avx512") == 0) return __builtin_cpu_supports("avx512f");
+#endif
+    return false;
+}
+
+// Picks the kernels by name, or the widest supported ones when name is "auto"
+static bool simd_select(const char *name)
+{
+    if (strcmp(name, "auto") == 0) {
+        for (size_t i = 0; i < NOB_ARRAY_LEN(simds); ++i) {
+            if (simd_supported(simds[i].name)) simd = simds[i];
+        }
+        return true;
+    }
+    for (size_t i = 0; i < NOB_ARRAY_LEN(simds); ++i) {
+        if (strcmp(simds[i].name, name) == 0 && simd_supported(name)) {
+            simd = simds[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// sse2 has no gathers, so its exact kernel is the scalar table lookup
+static void luminance_row(const uint32_t *pixels, float *out, int n, Lum lum)
+{
+    pthread_once(&lum_lut_once, lum_lut_init);
+    (lum == LUM_FIXED ? simd.lum_fixed : simd.lum_exact)(pixels, out, n);
+}
+
+// Only works before any seam is removed, while the rows of the image are still contiguous
+static void luminance(Img img, Mat lum, Lum mode)
+{
+    assert(img.width == lum.width);
+    assert(img.height == lum.height);
+    for (int y = 0; y < lum.height; ++y) {
+        luminance_row(&IMG_AT(img, y, 0), &MAT_AT(lum, y, 0), lum.width, mode);
+    }
+}
+
+// The span kernel of the stencil of the energy at the selected SIMD level. The half resolution
+// energy runs the sobel stencil over its blocks.
+static Stencil_Span energy_span(Energy energy)
+{
+    switch (energy) {
+    case ENERGY_E1: return simd.e1_span;
+    case ENERGY_SCHARR: return simd.scharr_span;
+    default: return simd.sobel_span;
+    }
+}
+
+// Like Stencil_Span, but the first and the last cell of the row see zeros past the edges of
+// the row. A row outside of the image has to be given as a row of zeros.
+static void stencil_row(Energy energy, const float *up, const float *mid, const float *down, float *out, int x0, int x1, int width)
+{
+    Stencil stencil = energy_stencil(energy);
+    int begin, end;
+    dp_row_interior(x0, x1, width, &begin, &end);
+    for (int cx = x0; cx < begin; ++cx) out[cx] = stencil_edge_cell(stencil, up, mid, down, cx, width);
+    energy_span(energy)(up, mid, down, out, begin, end);
+    for (int cx = end; cx < x1; ++cx) out[cx] = stencil_edge_cell(stencil, up, mid, down, cx, width);
+}
+
+// Averages the 2x2 blocks of src under the cells [x0, x1) of row y of dst, which is
+// (src.width + 1)/2 x (src.height + 1)/2. The blocks on the odd edges average only the cells
+// they have.
+static void mat_downsample_span(Mat src, Mat dst, int y, int x0, int x1)
+{
+    const float *top = &MAT_AT(src, 2*y, 0);
+    // The last row of an odd height pairs up with itself
+    const float *bottom = 2*y + 1 < src.height ? &MAT_AT(src, 2*y + 1, 0) : top;
+    float *out = &MAT_AT(dst, y, 0);
+    int pairs = src.width/2 < x1 ? src.width/2 : x1;
+    for (int x = x0; x < pairs; ++x) {
+        out[x] = (top[2*x] + top[2*x + 1] + bottom[2*x] + bottom[2*x + 1])*0.25f;
+    }
+    if (pairs < x1) out[pairs] = (top[2*pairs] + bottom[2*pairs])*0.5f;
+}
+
+// The half resolution energy does a quarter of the stencil work of the others. The blocks are
+// averaged straight into a guard-padded plane and every row of their energy is spread over
+// the cells of the blocks right away.
+static void half_filter(Mat mat, Mat grad)
+{
+    assert(mat.width == grad.width);
+    assert(mat.height == grad.height);
+
+    int width = (mat.width + 1)/2;
+    int height = (mat.height + 1)/2;
+    Mat padded = mat_alloc(width + 2, height + 2);
+    memset(&MAT_AT(padded, 0, 0), 0, padded.width*sizeof(float));
+    memset(&MAT_AT(padded, height + 1, 0), 0, padded.width*sizeof(float));
+    Mat half = {
+        .items = &MAT_AT(padded, 1, 1),
+        .width = width,
+        .height = height,
+        .stride = padded.stride,
+    };
+    for (int y = 0; y < height; ++y) {
+        MAT_AT(padded, y + 1, 0) = 0.0;
+        mat_downsample_span(mat, half, y, 0, width);
+        MAT_AT(padded, y + 1, width + 1) = 0.0;
+    }
+
+    float *row = heap_alloc(sizeof(*row)*width);
+    for (int y = 0; y < height; ++y) {
+        simd.sobel_span(&MAT_AT(padded, y, 1), &MAT_AT(padded, y + 1, 1), &MAT_AT(padded, y + 2, 1), row, 0, width);
+        for (int dy = 0; dy < 2 && 2*y + dy < grad.height; ++dy) {
+            float *out = &MAT_AT(grad, 2*y + dy, 0);
+            for (int x = 0; x < mat.width/2; ++x) out[2*x] = out[2*x + 1] = row[x];
+            if (mat.width%2 != 0) out[mat.width - 1] = row[width - 1];
+        }
+    }
+    heap_free(row);
+    storage_free(padded.items);
+}
+
+// The half resolution energy of a single cell, computed from the blocks of the current lum
+// exactly the way half_filter averages them. Used to repair the cells around the seams.
+static float half_cell(Mat lum, int cx, int cy)
+{
+    int bx = cx/2, by = cy/2;
+    float c[3][3];
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            int x = 2*(bx + dx);
+            int y = 2*(by + dy);
+            if (x < 0 || x >= lum.width || y < 0 || y >= lum.height) {
+                c[dy + 1][dx + 1] = 0.0;
+                continue;
+            }
+            const float *top = &MAT_AT(lum, y, 0);
+            const float *bottom = y + 1 < lum.height ? &MAT_AT(lum, y + 1, 0) : top;
+            c[dy + 1][dx + 1] = x + 1 < lum.width ? (top[x] + top[x + 1] + bottom[x] + bottom[x + 1])*0.25f
+                                                  : (top[x] + bottom[x])*0.5f;
+        }
+    }
+    return sobel(c);
+}
+
+// Computes lum and grad in a single pass over the pixels. Only a rolling window of three
+// guard-padded lum rows is kept, which stays in cache for any reasonable width. The rows of
+// lum are also stored when lum.items is not NULL, which the half resolution energy needs as
+// it makes a pass of its own.
+static void luminance_energy(Img img, Mat lum, Mat grad, Lum mode, Energy energy)
+{
+    assert(img.width == grad.width);
+    assert(img.height == grad.height);
+    if (energy == ENERGY_HALF) {
+        assert(lum.items != NULL);
+        luminance(img, lum, mode);
+        half_filter(lum, grad);
+        return;
+    }
+    int width = grad.width;
+    int height = grad.height;
+    int padded = width + 2;
+    Stencil_Span span = energy_span(energy);
+
+    // Three rows of the window and a row of zeros for the rows outside of the image
+    float *window = heap_calloc(4*padded, sizeof(*window));
+#define WINDOW_ROW(y) (0 <= (y) && (y) < height ? window + ((y)%3)*padded + 1 : window + 3*padded + 1)
+
+    for (int y = 0; y <= height; ++y) {
+        if (y < height) {
+            luminance_row(&IMG_AT(img, y, 0), WINDOW_ROW(y), width, mode);
+            if (lum.items != NULL) memcpy(&MAT_AT(lum, y, 0), WINDOW_ROW(y), width*sizeof(float));
+        }
+        if (y > 0) {
+            span(WINDOW_ROW(y - 2), WINDOW_ROW(y - 1), WINDOW_ROW(y), &MAT_AT(grad, y - 1, 0), 0, width);
+        }
+    }
+#undef WINDOW_ROW
+    heap_free(window);
+}
+
+// The forward energy counterpart of grad_to_dp. The first row only pays for the edge between
+// the neighbours of every pixel.
+static void lum_to_dp_forward(Mat lum, Mat dp)
+{
+    assert(lum.width == dp.width);
+    assert(lum.height == dp.height);
+    int width = lum.width;
+
+    const float *mid = &MAT_AT(lum, 0, 0);
+    float *out = &MAT_AT(dp, 0, 0);
+    for (int cx = 0; cx < width; ++cx) {
+        out[cx] = fabsf(mid[cx + 1 < width ? cx + 1 : cx] - mid[cx > 0 ? cx - 1 : cx]);
+    }
+    for (int y = 1; y < lum.height; ++y) {
+        const float *prev = &MAT_AT(dp, y - 1, 0);
+        const float *up = &MAT_AT(lum, y - 1, 0);
+        mid = &MAT_AT(lum, y, 0);
+        out = &MAT_AT(dp, y, 0);
+        int begin, end;
+        dp_row_interior(0, width, width, &begin, &end);
+        for (int cx = 0; cx < begin; ++cx) out[cx] = forward_edge_cell(prev, up, mid, cx, width);
+        simd.forward_span(prev, up, mid, out, begin, end);
+        for (int cx = end; cx < width; ++cx) out[cx] = forward_edge_cell(prev, up, mid, cx, width);
+    }
+}
+
+static void grad_to_dp(Mat grad, Mat dp)
+{
+    assert(grad.width == dp.width);
+    assert(grad.height == dp.height);
+
+    memcpy(&MAT_AT(dp, 0, 0), &MAT_AT(grad, 0, 0), grad.width*sizeof(float));
+    for (int y = 1; y < grad.height; ++y) {
+        simd.dp_row(&MAT_AT(dp, y - 1, 0), &MAT_AT(grad, y, 0), &MAT_AT(dp, y, 0), 0, grad.width, grad.width);
+    }
+}
+
+// Like grad_to_dp, but also records the directions of the seams into dirs. dp either has the
+// height of grad or is just two rows that are reused on the way down, in which case only the
+// bottom row survives. Returns the bottom row of dp.
+static const float *grad_to_dp_dirs(Mat grad, Mat dp, Dirs dirs)
+{
+    assert(grad.width == dp.width);
+    assert(grad.width == dirs.width);
+    assert(grad.height == dirs.height);
+    assert(grad.height == dp.height || dp.height == 2);
+
+    memcpy(&MAT_AT(dp, 0, 0), &MAT_AT(grad, 0, 0), grad.width*sizeof(float));
+    for (int y = 1; y < grad.height; ++y) {
+        simd.dp_dirs_row(&MAT_AT(dp, (y - 1)%dp.height, 0), &MAT_AT(grad, y, 0), &MAT_AT(dp, y%dp.height, 0),
+                         DIRS_LEFT(dirs, y), DIRS_RIGHT(dirs, y), 0, grad.width, grad.width);
+    }
+    return &MAT_AT(dp, (grad.height - 1)%dp.height, 0);
+}
+
+// Brings dp up to date after the seam was removed from both grad and dp. The cells of grad
+// in [patch_begin[y], patch_end[y]) were recomputed by the patch repair. Everything else in
+// grad only moved, so a cell of dp can change only if its gradient was repaired, if its
+// upper neighbours used to include the seam, or if one of its upper neighbours changed.
+// Each row is recomputed into the scratch row over that region only, and the region of the
+// next row grows from the cells between the first and the last one that actually changed.
+static void grad_to_dp_incremental(Mat grad, Mat dp, const int *seam, const int *patch_begin, const int *patch_end, float *scratch)
+{
+    assert(grad.width == dp.width);
+    assert(grad.height == dp.height);
+
+    int changed_begin = 0;
+    int changed_end = 0;
+    for (int y = 0; y < grad.height; ++y) {
+        int begin = patch_begin[y];
+        int end = patch_end[y];
+        if (y > 0) {
+            int lo = seam[y] < seam[y - 1] ? seam[y] : seam[y - 1];
+            int hi = seam[y] > seam[y - 1] ? seam[y] : seam[y - 1];
+            if (lo - 1 < begin) begin = lo - 1;
+            if (hi + 1 > end) end = hi + 1;
+            if (changed_begin < changed_end) {
+                if (changed_begin - 1 < begin) begin = changed_begin - 1;
+                if (changed_end + 1 > end) end = changed_end + 1;
+            }
+        }
+        if (begin < 0) begin = 0;
+        if (end > grad.width) end = grad.width;
+
+        if (y > 0) {
+            simd.dp_row(&MAT_AT(dp, y - 1, 0), &MAT_AT(grad, y, 0), scratch, begin, end, grad.width);
+        } else {
+            memcpy(scratch + begin, &MAT_AT(grad, 0, begin), (end - begin)*sizeof(float));
+        }
+
+        // Only the ends of the region are compared, the cells between them are copied over
+        // whether they changed or not
+        while (begin < end && memcmp(&scratch[begin], &MAT_AT(dp, y, begin), sizeof(float)) == 0) ++begin;
+        while (end > begin && memcmp(&scratch[end - 1], &MAT_AT(dp, y, end - 1), sizeof(float)) == 0) --end;
+        memcpy(&MAT_AT(dp, y, begin), &scratch[begin], (end - begin)*sizeof(float));
+        changed_begin = begin;
+        changed_end = end;
+    }
+}
+
+static bool mat_equal(Mat a, Mat b)
+{
+    if (a.width != b.width || a.height != b.height) return false;
+    for (int y = 0; y < a.height; ++y) {
+        if (memcmp(&MAT_AT(a, y, 0), &MAT_AT(b, y, 0), a.width*sizeof(float)) != 0) return false;
+    }
+    return true;
+}
+
+// A fixed set of threads that all run the same job. The calling thread takes part in every
+// job as the thread with index 0, and the threads of a job can meet at pool_sync.
+typedef struct Pool Pool;
+typedef void (*Pool_Job)(Pool *pool, void *arg, int index);
+
+typedef struct {
+    Pool *pool;
+    int index;
+} Pool_Worker;
+
+struct Pool {
+    int count;
+    pthread_t *threads;
+    Pool_Worker *workers;
+    pthread_barrier_t start, done, sync;
+    Pool_Job job;
+    void *arg;
+    bool quit;
+};
+
+static void *pool_worker(void *data)
+{
+    Pool_Worker *worker = data;
+    Pool *pool = worker->pool;
+    for (;;) {
+        pthread_barrier_wait(&pool->start);
+        if (pool->quit) break;
+        pool->job(pool, pool->arg, worker->index);
+        pthread_barrier_wait(&pool->done);
+    }
+    return NULL;
+}
+
+static Pool *pool_create(int count)
+{
+    assert(count >= 1);
+    Pool *pool = calloc(1, sizeof(*pool));
+    assert(pool != NULL);
+    pool->count = count;
+    pool->threads = malloc(sizeof(*pool->threads)*count);
+    pool->workers = malloc(sizeof(*pool->workers)*count);
+    assert(pool->threads != NULL && pool->workers != NULL);
+    pthread_barrier_init(&pool->start, NULL, count);
+    pthread_barrier_init(&pool->done, NULL, count);
+    pthread_barrier_init(&pool->sync, NULL, count);
+    for (int i = 1; i < count; ++i) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        int ret = pthread_create(&pool->threads[i], NULL, pool_worker, &pool->workers[i]);
+        assert(ret == 0);
+    }
+    return pool;
+}
+
+static void pool_run(Pool *pool, Pool_Job job, void *arg)
+{
+    pool->job = job;
+    pool->arg = arg;
+    pthread_barrier_wait(&pool->start);
+    job(pool, arg, 0);
+    pthread_barrier_wait(&pool->done);
+}
+
+static void pool_sync(Pool *pool)
+{
+    pthread_barrier_wait(&pool->sync);
+}
+
+static void pool_destroy(Pool *pool)
+{
+    pool->quit = true;
+    pthread_barrier_wait(&pool->start);
+    for (int i = 1; i < pool->count; ++i) pthread_join(pool->threads[i], NULL);
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    pthread_barrier_destroy(&pool->sync);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool);
+}
+
+// Trapezoid tiling of grad_to_dp. Every thread owns a column tile and walks the rows in
+// bands. Inside a band a thread also computes a halo around its tile that shrinks by one
+// cell per row on each side, which is exactly what the owned cells of the last row of the
+// band depend on, so the threads only have to meet once per band instead of once per row.
+// The halo is computed into per thread scratch rows and only the owned cells are written
+// to dp. Every cell still goes through the same row kernel, so the result is bit identical
+// to grad_to_dp.
+#define DP_BAND_ROWS 32
+
+typedef struct {
+    Pool *pool;
+    float *scratch; // two rows of max_width floats per thread
+    int max_width;
+    Mat grad, dp;
+    Dirs dirs;
+    const float *bottom;
+} Parallel_Dp;
+
+static Parallel_Dp parallel_dp_create(int threads, int max_width)
+{
+    Parallel_Dp pdp = {0};
+    pdp.pool = pool_create(threads);
+    pdp.max_width = max_width;
+    pdp.scratch = malloc(sizeof(float)*2*max_width*threads);
+    assert(pdp.scratch != NULL);
+    return pdp;
+}
+
+static void parallel_dp_destroy(Parallel_Dp pdp)
+{
+    pool_destroy(pdp.pool);
+    free(pdp.scratch);
+}
+
+// When dp is just two rows, the threads only publish the last row of every band, flipping
+// between the two rows from band to band.
+static void grad_to_dp_tile(Pool *pool, void *arg, int index)
+{
+    Parallel_Dp *pdp = arg;
+    Mat grad = pdp->grad;
+    Mat dp = pdp->dp;
+    Dirs dirs = pdp->dirs;
+    bool rolling = dp.height < grad.height;
+
+    // The tiles start at multiples of 8 so the threads never share a byte of dirs
+    int a = (int)((long)grad.width*index/pool->count) & ~7;
+    int b = index + 1 < pool->count ? (int)((long)grad.width*(index + 1)/pool->count) & ~7 : grad.width;
+    float *rows[2] = {
+        pdp->scratch + (size_t)2*pdp->max_width*index,
+        pdp->scratch + (size_t)2*pdp->max_width*index + pdp->max_width,
+    };
+
+    // Narrow tiles would spend most of the band on the halo. All the threads must agree on
+    // the band height since they meet at the end of every band.
+    int band = grad.width/pool->count/2;
+    if (band > DP_BAND_ROWS) band = DP_BAND_ROWS;
+    if (band < 1) band = 1;
+
+    memcpy(&MAT_AT(dp, 0, a), &MAT_AT(grad, 0, a), (b - a)*sizeof(float));
+    pool_sync(pool);
+
+    int bands = 0;
+    for (int y0 = 1; y0 < grad.height; y0 += band, ++bands) {
+        int y1 = y0 + band < grad.height ? y0 + band : grad.height;
+        for (int y = y0; y < y1; ++y) {
+            int halo = y1 - 1 - y;
+            int x0 = a - halo > 0 ? a - halo : 0;
+            int x1 = b + halo < grad.width ? b + halo : grad.width;
+            const float *prev = y > y0 ? rows[(y - 1)&1] : rolling ? &MAT_AT(dp, bands%2, 0) : &MAT_AT(dp, y - 1, 0);
+            const float *grad_row = &MAT_AT(grad, y, 0);
+            if (dirs.bits != NULL) {
+                simd.dp_row(prev, grad_row, rows[y&1], x0, a, grad.width);
+                simd.dp_dirs_row(prev, grad_row, rows[y&1], DIRS_LEFT(dirs, y), DIRS_RIGHT(dirs, y), a, b, grad.width);
+                simd.dp_row(prev, grad_row, rows[y&1], b, x1, grad.width);
+            } else {
+                simd.dp_row(prev, grad_row, rows[y&1], x0, x1, grad.width);
+            }
+            if (!rolling) {
+                memcpy(&MAT_AT(dp, y, a), rows[y&1] + a, (b - a)*sizeof(float));
+            } else if (y == y1 - 1) {
+                memcpy(&MAT_AT(dp, (bands + 1)%2, a), rows[y&1] + a, (b - a)*sizeof(float));
+            }
+        }
+        pool_sync(pool);
+    }
+
+    if (index == 0) {
+        pdp->bottom = rolling ? &MAT_AT(dp, bands%2, 0) : &MAT_AT(dp, grad.height - 1, 0);
+    }
+}
+
+// dirs.bits may be NULL when the directions are not needed. dp may be just two rows when
+// dirs are recorded. Returns the bottom row of dp.
+static const float *grad_to_dp_parallel(Parallel_Dp *pdp, Mat grad, Mat dp, Dirs dirs)
+{
+    assert(grad.width == dp.width);
+    assert(grad.height == dp.height || (dp.height == 2 && dirs.bits != NULL));
+    assert(grad.width <= pdp->max_width);
+    pdp->grad = grad;
+    pdp->dp = dp;
+    pdp->dirs = dirs;
+    pool_run(pdp->pool, grad_to_dp_tile, pdp);
+    return pdp->bottom;
+}
+
+// How many of the sorted columns of a row to remove by shifting the items on their left to
+// the right, the rest are removed by shifting the items on their right to the left. Picks the
+// split that moves the fewest items.
+static int removal_split(const int *columns, int count, int width)
+{
+    int best = 0;
+    int best_cost = width - columns[0] - count;
+    for (int left = 1; left <= count; ++left) {
+        int cost = columns[left - 1] - (left - 1);
+        if (left < count) cost += width - columns[left] - (count - left);
+        if (cost < best_cost) {
+            best = left;
+            best_cost = cost;
+        }
+    }
+    return best;
+}
+
+// Removes the sorted columns of a row of items of the given size in a single compaction pass.
+// The first left columns are removed by shifting towards the end of the row, so the row then
+// starts left items later.
+static void row_remove_columns(void *row, size_t size, int width, const int *columns, int count, int left)
+{
+    char *bytes = row;
+    for (int j = left - 1; j >= 0; --j) {
+        int begin = j > 0 ? columns[j - 1] + 1 : 0;
+        memmove(bytes + (begin + left - j)*size, bytes + begin*size, (columns[j] - begin)*size);
+    }
+    for (int j = left; j < count; ++j) {
+        int end = j + 1 < count ? columns[j + 1] : width;
+        memmove(bytes + (columns[j] - (j - left))*size, bytes + (columns[j] + 1)*size, (end - columns[j] - 1)*size);
+    }
+}
+
+static void img_remove_columns_at_row(Img img, int row, const int *columns, int count, int left)
+{
+    if (img.index != NULL) {
+        row_remove_columns(&img.index[(size_t)row*img.stride + ROW_OFFSET(img.offset, row)], sizeof(uint16_t), img.width, columns, count, left);
+    } else {
+        row_remove_columns(&IMG_AT(img, row, 0), sizeof(uint32_t), img.width, columns, count, left);
+    }
+}
+
+static void mat_remove_columns_at_row(Mat mat, int row, const int *columns, int count, int left)
+{
+    row_remove_columns(&MAT_AT(mat, row, 0), sizeof(float), mat.width, columns, count, left);
+}
+
+// Index maps only allow images up to this wide
+#define IMG_LAZY_MAX_WIDTH (UINT16_MAX + 1)
+
+static void img_make_lazy(Img *img)
+{
+    assert(img->width <= IMG_LAZY_MAX_WIDTH);
+    img->index = storage_alloc(sizeof(uint16_t)*img->stride*img->height);
+    assert(img->index != NULL);
+    for (int y = 0; y < img->height; ++y) {
+        for (int x = 0; x < img->width; ++x) {
+            img->index[(size_t)y*img->stride + x] = x;
+        }
+    }
+}
+
+// Moves the carved rows back to the start of their strides. For a lazily carved image that
+// means gathering the pixels that survived. The indices of a row only grow, so every row
+// can be compacted in place.
+static void img_materialize(Img *img)
+{
+    for (int y = 0; y < img->height; ++y) {
+        uint32_t *pixel_row = &img->pixels[(size_t)y*img->stride];
+        if (img->index != NULL) {
+            uint16_t *index_row = &img->index[(size_t)y*img->stride + ROW_OFFSET(img->offset, y)];
+            for (int x = 0; x < img->width; ++x) {
+                pixel_row[x] = pixel_row[index_row[x]];
+            }
+        } else if (img->offset != NULL) {
+            memmove(pixel_row, pixel_row + img->offset[y], img->width*sizeof(uint32_t));
+        }
+    }
+    storage_free(img->index);
+    img->index = NULL;
+    img->offset = NULL;
+}
+
+static void compute_seam(Mat dp, int *seam)
+{
+    int y = dp.height - 1;
+    seam[y] = 0;
+    for (int x = 1; x < dp.width; ++x) {
+        if (MAT_AT(dp, y, x) < MAT_AT(dp, y, seam[y])) {
+            seam[y] = x;
+        }
+    }
+
+    for (y = dp.height - 2; y >= 0; --y) {
+        seam[y] = seam[y+1];
+        for (int dx = -1; dx <= 1; ++dx) {
+            int x = seam[y+1] + dx;
+            if (0 <= x && x < dp.width && MAT_AT(dp, y, x) < MAT_AT(dp, y, seam[y])) {
+                seam[y] = x;
+            }
+        }
+    }
+}
+
+// compute_seam for lum_to_dp_forward. The step into a cell is the one that produced its dp,
+// so the previous cell is picked by its dp plus the cost of the step, in the order
+// forward_cell compares them.
+static void compute_seam_forward(Mat dp, Mat lum, int *seam)
+{
+    int width = dp.width;
+    int y = dp.height - 1;
+    seam[y] = 0;
+    for (int x = 1; x < width; ++x) {
+        if (MAT_AT(dp, y, x) < MAT_AT(dp, y, seam[y])) {
+            seam[y] = x;
+        }
+    }
+
+    for (; y > 0; --y) {
+        int cx = seam[y];
+        const float *prev = &MAT_AT(dp, y - 1, 0);
+        const float *mid = &MAT_AT(lum, y, 0);
+        float cu, cl, cr;
+        FORWARD_COSTS(mid[cx > 0 ? cx - 1 : cx], mid[cx + 1 < width ? cx + 1 : cx], MAT_AT(lum, y - 1, cx), cu, cl, cr);
+        float m = prev[cx] + cu;
+        seam[y - 1] = cx;
+        if (cx > 0 && prev[cx - 1] + cl < m) {
+            m = prev[cx - 1] + cl;
+            seam[y - 1] = cx - 1;
+        }
+        if (cx + 1 < width && prev[cx + 1] + cr < m) seam[y - 1] = cx + 1;
+    }
+}
+
+// The seam starts at the minimum of the bottom row of dp and simply follows dirs upwards
+static void compute_seam_dirs(const float *bottom, Dirs dirs, int *seam)
+{
+    int y = dirs.height - 1;
+    seam[y] = 0;
+    for (int x = 1; x < dirs.width; ++x) {
+        if (bottom[x] < bottom[seam[y]]) {
+            seam[y] = x;
+        }
+    }
+
+    for (; y > 0; --y) {
+        seam[y - 1] = seam[y] + DIRS_AT(dirs, y, seam[y]);
+    }
+}
+
+// grad_to_dp and compute_seam restricted to band columns of every row starting at begin[y].
+// dp holds grad.height rows of band cells. The cells outside of the band are infinitely
+// expensive, so the seam never leaves it.
+static void seam_banded(Mat grad, float *dp, const int *begin, int band, int *seam)
+{
+    for (int x = 0; x < band; ++x) dp[x] = MAT_AT(grad, 0, begin[0] + x);
+    for (int y = 1; y < grad.height; ++y) {
+        const float *prev = &dp[(size_t)(y - 1)*band];
+        float *row = &dp[(size_t)y*band];
+        const float *grad_row = &MAT_AT(grad, y, 0) + begin[y];
+        int shift = begin[y] - begin[y - 1];
+        for (int x = 0; x < band; ++x) {
+            float m = INFINITY;
+            for (int dx = -1; dx <= 1; ++dx) {
+                int px = x + shift + dx;
+                if (0 <= px && px < band && prev[px] < m) m = prev[px];
+            }
+            row[x] = grad_row[x] + m;
+        }
+    }
+
+    int y = grad.height - 1;
+    const float *row = &dp[(size_t)y*band];
+    int best = 0;
+    for (int x = 1; x < band; ++x) {
+        if (row[x] < row[best]) best = x;
+    }
+    seam[y] = begin[y] + best;
+
+    for (y = grad.height - 2; y >= 0; --y) {
+        row = &dp[(size_t)y*band];
+        best = seam[y + 1] - begin[y];
+        for (int dx = -1; dx <= 1; ++dx) {
+            int x = seam[y + 1] - begin[y] + dx;
+            if (0 <= x && x < band && (best < 0 || best >= band || row[x] < row[best])) best = x;
+        }
+        seam[y] = begin[y] + best;
+    }
+}
+
+#define TAKEN_AT(taken, stride, row, col) ((taken)[(size_t)(row)*(stride) + (col)/8] >> ((col)%8) & 1)
+#define TAKEN_FLIP(taken, stride, row, col) ((taken)[(size_t)(row)*(stride) + (col)/8] ^= 1 << ((col)%8))
+
+// Whether the seam at (y, x) may continue to (y - 1, x + dx) without stepping on or across a
+// seam found before it
+static bool seam_step_free(uint8_t *taken, int stride, int width, int y, int x, int dx)
+{
+    int nx = x + dx;
+    if (nx < 0 || nx >= width) return false;
+    if (TAKEN_AT(taken, stride, y - 1, nx)) return false;
+    if (dx != 0 && TAKEN_AT(taken, stride, y, nx) && TAKEN_AT(taken, stride, y - 1, x)) return false;
+    return true;
+}
+
+// Extracts up to k seams out of a single dp. The seams start at the k smallest cells of the
+// bottom row and are walked up one after another, each one taking the cheapest step that
+// neither steps on nor crosses a seam found before it. With the whole dp at hand the steps
+// are chosen by dp, otherwise the seams follow dirs. A seam that gets boxed in is dropped.
+// The first seam is always the one compute_seam would find. taken is a bit set with stride
+// bytes per row that has to be clear on entry and is left clear. Returns the number of seams
+// written to seams, height ints each.
+static int compute_seams(Mat dp, const float *bottom, Dirs dirs, int k, int *seams, uint8_t *taken, int stride)
+{
+    int width = dp.width;
+    int height = dirs.bits != NULL ? dirs.height : dp.height;
+    bool use_dp = dp.height == height;
+    if (use_dp) bottom = &MAT_AT(dp, height - 1, 0);
+
+    // Insertion sort of the k smallest cells of the bottom row, first index wins ties
+    int *ends = heap_alloc(sizeof(*ends)*k);
+    int count = 0;
+    for (int x = 0; x < width; ++x) {
+        if (count == k && !(bottom[x] < bottom[ends[count - 1]])) continue;
+        int j = count < k ? count++ : count - 1;
+        for (; j > 0 && bottom[x] < bottom[ends[j - 1]]; --j) ends[j] = ends[j - 1];
+        ends[j] = x;
+    }
+
+    int found = 0;
+    for (int i = 0; i < count; ++i) {
+        int *seam = seams + (size_t)found*height;
+        int y = height - 1;
+        seam[y] = ends[i];
+        TAKEN_FLIP(taken, stride, y, seam[y]);
+        for (; y > 0; --y) {
+            int x = seam[y];
+            int next = -1;
+            if (use_dp) {
+                static const int steps[] = {0, -1, 1};
+                for (size_t j = 0; j < NOB_ARRAY_LEN(steps); ++j) {
+                    int dx = steps[j];
+                    if (!seam_step_free(taken, stride, width, y, x, dx)) continue;
+                    if (next < 0 || MAT_AT(dp, y - 1, x + dx) < MAT_AT(dp, y - 1, next)) next = x + dx;
+                }
+            } else {
+                int dx = DIRS_AT(dirs, y, x);
+                if (seam_step_free(taken, stride, width, y, x, dx)) next = x + dx;
+            }
+            if (next < 0) break;
+            seam[y - 1] = next;
+            TAKEN_FLIP(taken, stride, y - 1, next);
+        }
+        if (y > 0) {
+            for (int yy = y; yy < height; ++yy) TAKEN_FLIP(taken, stride, yy, seam[yy]);
+        } else {
+            found += 1;
+        }
+    }
+
+    for (int i = 0; i < found; ++i) {
+        for (int y = 0; y < height; ++y) TAKEN_FLIP(taken, stride, y, seams[(size_t)i*height + y]);
+    }
+    heap_free(ends);
+    return found;
+}
+
+// The cells of row y whose energy depended on a pixel of the seam, in the coordinates of the
+// row after the sorted columns were removed from it. That is the neighbourhoods of the given
+// reach around the seam pixels in rows y - reach to y + reach, without the removed columns.
+static void seam_patch_at_row(const int *seam, int height, int y, int reach, const int *columns, int count, int width, int *begin, int *end)
+{
+    int lo = seam[y];
+    int hi = seam[y];
+    for (int dy = -reach; dy <= reach; ++dy) {
+        if (0 <= y + dy && y + dy < height) {
+            if (seam[y + dy] < lo) lo = seam[y + dy];
+            if (seam[y + dy] > hi) hi = seam[y + dy];
+        }
+    }
+    int first = lo - reach > 0 ? lo - reach : 0;
+    int last = hi + 1 + reach < width ? hi + 1 + reach : width;
+    int before_first = 0, before_last = 0;
+    for (int j = 0; j < count; ++j) {
+        if (columns[j] < first) before_first += 1;
+        if (columns[j] < last) before_last += 1;
+    }
+    *begin = first - before_first;
+    *end = last - before_last;
+}
+
+// Recomputes grad over [begin[y], end[y]) of every row. zeros stands in for the rows above
+// and below the image and has to be at least as wide as them.
+static void energy_filter_patches(Mat lum, Mat grad, const int *begin, const int *end, const float *zeros, Energy energy)
+{
+    for (int y = 0; y < grad.height; ++y) {
+        if (begin[y] >= end[y]) continue;
+        if (energy == ENERGY_HALF) {
+            // Removing a seam shifts the blocks right of it by a cell, which only the cells
+            // within reach of it are repaired for
+            for (int x = begin[y]; x < end[y]; ++x) MAT_AT(grad, y, x) = half_cell(lum, x, y);
+            continue;
+        }
+        const float *up = y > 0 ? &MAT_AT(lum, y - 1, 0) : zeros;
+        const float *down = y + 1 < lum.height ? &MAT_AT(lum, y + 1, 0) : zeros;
+        stencil_row(energy, up, &MAT_AT(lum, y, 0), down, &MAT_AT(grad, y, 0), begin[y], end[y], grad.width);
+    }
+}
+
+// Converts the columns [x0, x1) of row y of the carved image to lum. out is indexed by the
+// absolute column. The pixels of a lazy image are gathered into pixels first.
+static void img_luminance_span(Img img, int y, int x0, int x1, float *out, uint32_t *pixels, Lum mode)
+{
+    if (img.index != NULL) {
+        for (int x = x0; x < x1; ++x) pixels[x] = IMG_AT(img, y, x);
+    } else {
+        pixels = &IMG_AT(img, y, 0);
+    }
+    luminance_row(pixels + x0, out + x0, x1 - x0, mode);
+}
+
+// Same as energy_filter_patches without a lum plane, for the stencil energies. The three lum
+// rows around every patch are recomputed from the pixels into rows, which holds three rows of
+// grad.width floats.
+static void stencil_filter_patches_from_pixels(Img img, Mat grad, const int *begin, const int *end, const float *zeros,
+                                               float *rows, uint32_t *pixels, Lum mode, Energy energy)
+{
+    for (int y = 0; y < grad.height; ++y) {
+        if (begin[y] >= end[y]) continue;
+        int x0 = begin[y] > 0 ? begin[y] - 1 : 0;
+        int x1 = end[y] < grad.width ? end[y] + 1 : grad.width;
+        const float *window[3];
+        for (int dy = -1; dy <= 1; ++dy) {
+            if (y + dy < 0 || y + dy >= grad.height) {
+                window[dy + 1] = zeros;
+            } else {
+                float *row = rows + (dy + 1)*grad.width;
+                img_luminance_span(img, y + dy, x0, x1, row, pixels, mode);
+                window[dy + 1] = row;
+            }
+        }
+        stencil_row(energy, window[0], window[1], window[2], &MAT_AT(grad, y, 0), begin[y], end[y], grad.width);
+    }
+}
+
+static float stencil_at_cells(Cells cells, Stencil stencil, int cx, int cy)
+{
+    float c[3][3];
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            int x = cx + dx;
+            int y = cy + dy;
+            c[dy + 1][dx + 1] = MAT_WITHIN(cells, y, x) ? CELLS_AT(cells, y, x).lum : 0.0;
+        }
+    }
+    return stencil(c);
+}
+
+// The dp kernels want a contiguous gradient row, so every row of grad is gathered into
+// grad_row first
+static void cells_to_dp(Cells cells, Mat dp, float *grad_row)
+{
+    assert(cells.width == dp.width);
+    assert(cells.height == dp.height);
+
+    for (int y = 0; y < cells.height; ++y) {
+        for (int x = 0; x < cells.width; ++x) grad_row[x] = CELLS_AT(cells, y, x).grad;
+        if (y == 0) {
+            memcpy(&MAT_AT(dp, 0, 0), grad_row, cells.width*sizeof(float));
+        } else {
+            simd.dp_row(&MAT_AT(dp, y - 1, 0), grad_row, &MAT_AT(dp, y, 0), 0, cells.width, cells.width);
+        }
+    }
+}
+
+typedef enum {
+    LAYOUT_PLANAR,
+    LAYOUT_AOS,
+} Layout;
+
+typedef struct {
+    bool incremental;
+    bool verify;
+    bool dirs;
+    bool rolling;
+    bool lazy;
+    int seams_per_pass;
+    int threads;
+    Layout layout;
+    Lum lum;
+    Energy energy;
+    bool lum_on_demand;
+    bool ranks;
+    bool forward;
+    int pyramid; // coarse levels of the seam search, 0 searches the full resolution only
+    int band; // columns on both sides of the upsampled seam that a finer level searches
+} Options;
+
+#define PYRAMID_MAX_LEVELS 8
+
+// A level of the seam search pyramid, the finer level averaged over 2x2 blocks. Every seam
+// found on a level guides two seams of the finer level. Removing those shifts the finer
+// columns by two, so the level stays aligned with it by removing its own seam too and
+// averaging the few blocks around it again.
+typedef struct {
+    Mat grad;
+    int *offset;
+    int *seam;
+    int uses; // how many more seams of the finer level the seam guides
+    bool pending; // the seam has been found but not removed from the level yet
+} Level;
+
+// Everything needed to carve seams out of an image. The planar layout keeps the pixels,
+// lum and grad in separate planes, the AoS layout interleaves them in cells.
+typedef struct {
+    Options opts;
+    Img img;
+    Cells cells;
+    Mat lum, grad, dp, dp_check;
+    Dirs dirs;
+    int *offset;
+    int *seam; // opts.seams_per_pass seams of img.height ints
+    int *columns;
+    int *patch_begin, *patch_end; // opts.seams_per_pass patches of img.height ints
+    float *dp_scratch;
+    float *zeros;
+    float *lum_rows; // three rows of lum around a patch when there is no lum plane
+    uint32_t *lum_pixels;
+    uint16_t *ranks; // the seam that removed every pixel of the original image when opts.ranks
+    uint8_t *taken;
+    int taken_stride;
+    Parallel_Dp pdp;
+    Level pyramid[PYRAMID_MAX_LEVELS]; // pyramid[l - 1] is level l, level 0 is grad itself
+    float *band_dp;
+    int *band_begin;
+    double energy; // the grad of all the removed pixels, 0 with forward energy
+    int removed;
+    int removal_count; // the seams of the pass that the pool is removing
+    double *removal_energy; // the grad that every thread of the pool has removed in the pass
+} Carver;
+
+// The carver works on the pixels of img in place
+static Carver carver_create(Img img, Options opts)
+{
+    Carver c = {0};
+    c.opts = opts;
+    int width = img.width;
+    int height = img.height;
+
+    if (opts.lazy) {
+        if (width <= IMG_LAZY_MAX_WIDTH) {
+            img_make_lazy(&img);
+        } else {
+            fprintf(stderr, "WARNING: the image is too wide for --lazy, carving the pixels directly\n");
+        }
+    }
+
+    c.offset = heap_calloc(height, sizeof(*c.offset));
+    img.offset = c.offset;
+    c.img = img;
+
+    if (opts.layout == LAYOUT_AOS) {
+        c.cells.items = storage_alloc(sizeof(Cell)*width*height);
+        assert(c.cells.items != NULL);
+        c.cells.offset = c.offset;
+        c.cells.width = width;
+        c.cells.height = height;
+        c.cells.stride = width;
+        float *lum = heap_alloc(sizeof(*lum)*width);
+        for (int y = 0; y < height; ++y) {
+            const uint32_t *pixels = &IMG_AT(img, y, 0);
+            luminance_row(pixels, lum, width, opts.lum);
+            for (int x = 0; x < width; ++x) {
+                CELLS_AT(c.cells, y, x) = (Cell) { .pixel = pixels[x], .lum = lum[x] };
+            }
+        }
+        heap_free(lum);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                CELLS_AT(c.cells, y, x).grad = stencil_at_cells(c.cells, energy_stencil(opts.energy), x, y);
+            }
+        }
+    } else {
+        if (opts.lum_on_demand) {
+            c.lum_rows = heap_alloc(sizeof(*c.lum_rows)*3*width);
+            c.lum_pixels = heap_alloc(sizeof(*c.lum_pixels)*width);
+        } else {
+            c.lum = mat_alloc(width, height);
+            c.lum.offset = c.offset;
+        }
+        if (opts.forward) {
+            // Forward energy searches the seams on lum alone, there is no grad to keep up
+            luminance(img, c.lum, opts.lum);
+        } else {
+            c.grad = mat_alloc(width, height);
+            c.grad.offset = c.offset;
+            luminance_energy(img, c.lum, c.grad, opts.lum, opts.energy);
+        }
+    }
+
+    if (opts.pyramid > 0) {
+        // The full dp is only needed at the coarsest level
+        Mat finer = c.grad;
+        for (int l = 0; l < opts.pyramid; ++l) {
+            Level *level = &c.pyramid[l];
+            level->grad = mat_alloc((finer.width + 1)/2, (finer.height + 1)/2);
+            level->offset = heap_calloc(level->grad.height, sizeof(*level->offset));
+            level->seam = heap_alloc(sizeof(*level->seam)*level->grad.height);
+            level->grad.offset = level->offset;
+            for (int y = 0; y < level->grad.height; ++y) {
+                mat_downsample_span(finer, level->grad, y, 0, level->grad.width);
+            }
+            finer = level->grad;
+        }
+        c.dp = mat_alloc(finer.width, finer.height);
+        c.band_dp = storage_alloc(sizeof(*c.band_dp)*height*(2*opts.band + 2));
+        c.band_begin = heap_alloc(sizeof(*c.band_begin)*height);
+    } else {
+        c.dp = mat_alloc(width, opts.rolling ? 2 : height);
+    }
+    if (opts.incremental) c.dp.offset = c.offset;
+    if (opts.verify) c.dp_check = mat_alloc(width, height);
+    if (opts.dirs) c.dirs = dirs_alloc(width, height);
+    c.seam = heap_alloc(sizeof(*c.seam)*height*opts.seams_per_pass);
+    // Every thread of the pool removes the seams from a band of rows with columns of its own
+    int removers = opts.threads > 1 ? opts.threads : 1;
+    c.columns = heap_alloc(sizeof(*c.columns)*opts.seams_per_pass*removers);
+    c.patch_begin = heap_alloc(sizeof(*c.patch_begin)*height*opts.seams_per_pass);
+    c.patch_end = heap_alloc(sizeof(*c.patch_end)*height*opts.seams_per_pass);
+    c.dp_scratch = heap_alloc(sizeof(*c.dp_scratch)*width);
+    c.zeros = heap_calloc(width, sizeof(*c.zeros));
+    c.taken_stride = (width + 7)/8;
+    if (opts.seams_per_pass > 1) {
+        c.taken = heap_calloc((size_t)c.taken_stride*height, 1);
+    }
+    if (opts.threads > 1) {
+        c.pdp = parallel_dp_create(opts.threads, width);
+        c.removal_energy = heap_alloc(sizeof(*c.removal_energy)*opts.threads);
+    }
+    if (opts.ranks) {
+        // The index map is what tells the original column of a carved pixel. The pixels that
+        // are never removed keep a rank past any seam.
+        assert(c.img.index != NULL);
+        c.ranks = storage_alloc(sizeof(*c.ranks)*width*height);
+        for (size_t i = 0; i < (size_t)width*height; ++i) c.ranks[i] = UINT16_MAX;
+    }
+    return c;
+}
+
+// Sorts the columns of the seams at row y into columns
+static void carver_sort_columns(Carver *c, int count, int y, int *columns)
+{
+    for (int j = 0; j < count; ++j) {
+        int cx = c->seam[j*c->img.height + y];
+        int l = j;
+        for (; l > 0 && columns[l - 1] > cx; --l) columns[l] = columns[l - 1];
+        columns[l] = cx;
+    }
+}
+
+static Mat carver_level(Carver *c, int l)
+{
+    return l > 0 ? c->pyramid[l - 1].grad : c->grad;
+}
+
+// Finds a seam of level l. The coarsest level runs the full dp, every finer one only runs it
+// within opts.band columns on both sides of the upsampled seam of the coarser level, which
+// is found first when the current one has guided its two seams already.
+static void carver_pyramid_seam(Carver *c, int l, int *seam)
+{
+    Mat grad = carver_level(c, l);
+    if (l == c->opts.pyramid) {
+        c->dp.width = grad.width;
+        c->dp.stride = grad.width;
+        grad_to_dp(grad, c->dp);
+        compute_seam(c->dp, seam);
+        return;
+    }
+
+    Level *coarser = &c->pyramid[l];
+    if (coarser->uses == 0) {
+        carver_pyramid_seam(c, l + 1, coarser->seam);
+        coarser->uses = 2;
+        coarser->pending = true;
+    }
+    coarser->uses -= 1;
+
+    int band = 2*c->opts.band + 2;
+    if (band > grad.width) band = grad.width;
+    // A coarse column covers two fine ones, the band is centered on both
+    for (int y = 0; y < grad.height; ++y) {
+        int begin = 2*coarser->seam[y/2] - c->opts.band;
+        if (begin > grad.width - band) begin = grad.width - band;
+        if (begin < 0) begin = 0;
+        c->band_begin[y] = begin;
+    }
+    seam_banded(grad, c->band_dp, c->band_begin, band, seam);
+}
+
+// Removes the seams of the levels whose finer seams are all gone, from the finest level up
+static void carver_pyramid_remove(Carver *c)
+{
+    for (int l = 1; l <= c->opts.pyramid; ++l) {
+        Level *level = &c->pyramid[l - 1];
+        if (!level->pending || level->uses > 0 || (l > 1 && c->pyramid[l - 2].pending)) break;
+        Mat finer = carver_level(c, l - 1);
+        // The finer seams stay within the band around the seam and the finer level only
+        // changed around them, so the blocks further away than that are still aligned
+        int reach = c->opts.band + 2;
+        for (int y = 0; y < level->grad.height; ++y) {
+            int x = level->seam[y];
+            int left = removal_split(&x, 1, level->grad.width);
+            mat_remove_columns_at_row(level->grad, y, &x, 1, left);
+            level->offset[y] += left;
+        }
+        level->grad.width -= 1;
+        for (int y = 0; y < level->grad.height; ++y) {
+            int x0 = level->seam[y] - reach;
+            int x1 = level->seam[y] + reach;
+            mat_downsample_span(finer, level->grad, y, x0 > 0 ? x0 : 0, x1 < level->grad.width ? x1 : level->grad.width);
+        }
+        level->pending = false;
+    }
+}
+
+// Removes count seams from the rows [y0, y1) and records the patches around them. columns
+// holds count ints of scratch and the grad of the removed pixels is added to energy. Without
+// a grad plane there are neither patches nor energy.
+static void carver_remove_rows(Carver *c, int count, int y0, int y1, int *columns, double *energy)
+{
+    Mat lum = c->lum;
+    Mat grad = c->grad;
+    int width = c->img.width;
+    int height = c->img.height;
+    for (int cy = y0; cy < y1; ++cy) {
+        carver_sort_columns(c, count, cy, columns);
+        if (grad.items != NULL) {
+            for (int j = 0; j < count; ++j) {
+                seam_patch_at_row(c->seam + j*height, height, cy, energy_reach(c->opts.energy), columns, count, width,
+                                  &c->patch_begin[j*height + cy], &c->patch_end[j*height + cy]);
+            }
+            for (int j = 0; j < count; ++j) *energy += MAT_AT(grad, cy, c->seam[j*height + cy]);
+        }
+        if (c->ranks != NULL) {
+            for (int j = 0; j < count; ++j) {
+                c->ranks[(size_t)cy*c->img.stride + IMG_COLUMN(c->img, cy, c->seam[j*height + cy])] = c->removed + j;
+            }
+        }
+        int left = removal_split(columns, count, width);
+        img_remove_columns_at_row(c->img, cy, columns, count, left);
+        if (lum.items != NULL) mat_remove_columns_at_row(lum, cy, columns, count, left);
+        if (grad.items != NULL) mat_remove_columns_at_row(grad, cy, columns, count, left);
+        if (c->opts.incremental) mat_remove_columns_at_row(c->dp, cy, columns, count, left);
+        c->offset[cy] += left;
+    }
+}
+
+// Every row is carved on its own, so the threads of the pool take a band of rows each
+static void carver_remove_band(Pool *pool, void *arg, int index)
+{
+    Carver *c = arg;
+    int height = c->img.height;
+    int y0 = (int)((int64_t)height*index/pool->count);
+    int y1 = (int)((int64_t)height*(index + 1)/pool->count);
+    c->removal_energy[index] = 0;
+    carver_remove_rows(c, c->removal_count, y0, y1, c->columns + index*c->opts.seams_per_pass, &c->removal_energy[index]);
+}
+
+static int carver_pass_planar(Carver *c, int k)
+{
+    Mat lum = c->lum;
+    Mat grad = c->grad;
+    int height = c->img.height;
+
+    const float *bottom = NULL;
+    if (c->opts.pyramid > 0) {
+        carver_pyramid_seam(c, 0, c->seam);
+    } else if (c->opts.forward) {
+        lum_to_dp_forward(lum, c->dp);
+    } else if (c->opts.incremental && c->removed > 0) {
+        grad_to_dp_incremental(grad, c->dp, c->seam, c->patch_begin, c->patch_end, c->dp_scratch);
+        if (c->opts.verify) {
+            c->dp_check.width = c->dp.width;
+            grad_to_dp(grad, c->dp_check);
+            if (!mat_equal(c->dp, c->dp_check)) {
+                fprintf(stderr, "ERROR: incremental dp diverged from the full recompute at seam %d\n", c->removed);
+                return -1;
+            }
+        }
+    } else if (c->pdp.pool != NULL) {
+        bottom = grad_to_dp_parallel(&c->pdp, grad, c->dp, c->dirs);
+    } else if (c->opts.dirs) {
+        bottom = grad_to_dp_dirs(grad, c->dp, c->dirs);
+    } else {
+        grad_to_dp(grad, c->dp);
+    }
+
+    int count = 1;
+    if (c->opts.pyramid > 0) {
+        // carver_pyramid_seam has found the seam already
+    } else if (c->opts.forward) {
+        compute_seam_forward(c->dp, lum, c->seam);
+    } else if (k > 1) {
+        count = compute_seams(c->dp, bottom, c->dirs, k, c->seam, c->taken, c->taken_stride);
+    } else if (c->opts.dirs) {
+        compute_seam_dirs(bottom, c->dirs, c->seam);
+    } else {
+        compute_seam(c->dp, c->seam);
+    }
+
+    if (c->pdp.pool != NULL) {
+        c->removal_count = count;
+        pool_run(c->pdp.pool, carver_remove_band, c);
+        // Summed in the order of the bands, so the total does not depend on the timing
+        for (int i = 0; i < c->pdp.pool->count; ++i) c->energy += c->removal_energy[i];
+    } else {
+        carver_remove_rows(c, count, 0, height, c->columns, &c->energy);
+    }
+
+    c->img.width -= count;
+    c->lum.width -= count;
+    c->grad.width -= count;
+    c->dp.width -= count;
+    c->dirs.width -= count;
+
+    for (int j = 0; grad.items != NULL && j < count; ++j) {
+        const int *begin = c->patch_begin + j*height;
+        const int *end = c->patch_end + j*height;
+        if (lum.items != NULL) {
+            energy_filter_patches(c->lum, c->grad, begin, end, c->zeros, c->opts.energy);
+        } else {
+            stencil_filter_patches_from_pixels(c->img, c->grad, begin, end, c->zeros, c->lum_rows, c->lum_pixels,
+                                               c->opts.lum, c->opts.energy);
+        }
+    }
+    if (c->opts.pyramid > 0) carver_pyramid_remove(c);
+
+    return count;
+}
+
+static int carver_pass_aos(Carver *c, int k)
+{
+    Cells cells = c->cells;
+    int height = cells.height;
+
+    cells_to_dp(cells, c->dp, c->dp_scratch);
+    int count = 1;
+    if (k > 1) {
+        count = compute_seams(c->dp, NULL, (Dirs){0}, k, c->seam, c->taken, c->taken_stride);
+    } else {
+        compute_seam(c->dp, c->seam);
+    }
+
+    for (int cy = 0; cy < height; ++cy) {
+        carver_sort_columns(c, count, cy, c->columns);
+        for (int j = 0; j < count; ++j) {
+            seam_patch_at_row(c->seam + j*height, height, cy, 1, c->columns, count, cells.width,
+                              &c->patch_begin[j*height + cy], &c->patch_end[j*height + cy]);
+        }
+        for (int j = 0; j < count; ++j) c->energy += CELLS_AT(cells, cy, c->seam[j*height + cy]).grad;
+        int left = removal_split(c->columns, count, cells.width);
+        row_remove_columns(&CELLS_AT(cells, cy, 0), sizeof(Cell), cells.width, c->columns, count, left);
+        c->offset[cy] += left;
+    }
+
+    c->img.width -= count;
+    c->cells.width -= count;
+    c->dp.width -= count;
+    cells = c->cells;
+
+    for (int j = 0; j < count; ++j) {
+        for (int cy = 0; cy < height; ++cy) {
+            for (int cx = c->patch_begin[j*height + cy]; cx < c->patch_end[j*height + cy]; ++cx) {
+                CELLS_AT(cells, cy, cx).grad = stencil_at_cells(cells, energy_stencil(c->opts.energy), cx, cy);
+            }
+        }
+    }
+
+    return count;
+}
+
+// Returns false if --verify caught the incremental dp diverging
+static bool carver_remove_seams(Carver *c, int seams)
+{
+    while (seams > 0) {
+        int k = seams < c->opts.seams_per_pass ? seams : c->opts.seams_per_pass;
+        int count = c->opts.layout == LAYOUT_AOS ? carver_pass_aos(c, k) : carver_pass_planar(c, k);
+        if (count < 0) return false;
+        c->removed += count;
+        seams -= count;
+    }
+    return true;
+}
+
+// The carved image, moved to the start of the rows of the original pixels
+static Img carver_result(Carver *c)
+{
+    if (c->opts.layout == LAYOUT_AOS) {
+        for (int y = 0; y < c->cells.height; ++y) {
+            uint32_t *pixel_row = &c->img.pixels[(size_t)y*c->img.stride];
+            for (int x = 0; x < c->cells.width; ++x) pixel_row[x] = CELLS_AT(c->cells, y, x).pixel;
+        }
+        storage_free(c->img.index);
+        c->img.index = NULL;
+        c->img.offset = NULL;
+    } else {
+        img_materialize(&c->img);
+    }
+    return c->img;
+}
+
+// Frees everything but the pixels
+static void carver_destroy(Carver *c)
+{
+    if (c->pdp.pool != NULL) parallel_dp_destroy(c->pdp);
+    storage_free(c->img.index);
+    storage_free(c->cells.items);
+    storage_free(c->lum.items);
+    heap_free(c->lum_rows);
+    heap_free(c->lum_pixels);
+    storage_free(c->grad.items);
+    storage_free(c->dp.items);
+    storage_free(c->dp_check.items);
+    storage_free(c->dirs.bits);
+    heap_free(c->offset);
+    heap_free(c->seam);
+    heap_free(c->columns);
+    heap_free(c->removal_energy);
+    heap_free(c->patch_begin);
+    heap_free(c->patch_end);
+    heap_free(c->dp_scratch);
+    heap_free(c->zeros);
+    heap_free(c->taken);
+    storage_free(c->ranks);
+    for (int l = 0; l < c->opts.pyramid; ++l) {
+        storage_free(c->pyramid[l].grad.items);
+        heap_free(c->pyramid[l].offset);
+        heap_free(c->pyramid[l].seam);
+    }
+    storage_free(c->band_dp);
+    heap_free(c->band_begin);
+    memset(c, 0, sizeof(*c));
+}
+
+// Writes every pixel of src followed by a copy of it for the pixels that the first count seams
+// of the ranks went through. The copy averages the pixel with its right neighbour, so the
+// inserted seam blends in.
+static void img_insert_seams(Img src, const uint16_t *ranks, int count, Img dst)
+{
+    for (int y = 0; y < src.height; ++y) {
+        const uint32_t *pixel_row = &src.pixels[(size_t)y*src.stride];
+        const uint16_t *rank_row = &ranks[(size_t)y*src.width];
+        uint32_t *out = &dst.pixels[(size_t)y*dst.stride];
+        int n = 0;
+        for (int x = 0; x < src.width; ++x) {
+            out[n++] = pixel_row[x];
+            if (rank_row[x] < count) {
+                uint32_t a = pixel_row[x];
+                uint32_t b = pixel_row[x + 1 < src.width ? x + 1 : x];
+                // The average of every channel without unpacking them
+                out[n++] = (a & b) + (((a ^ b) >> 1) & 0x7F7F7F7F);
+            }
+        }
+        assert(n == dst.width);
+    }
+}
+
+// Widens img to width by duplicating its lowest energy seams. The seams are only carved out
+// of the index map of a lazy carver, the ranks tell which pixels they went through and all
+// of them are inserted in a single pass over the image. Every round adds at most half of the
+// width, so the same seams do not get stretched over and over. The result goes into a new
+// buffer from storage_alloc and the old one is left alone.
+static bool img_enlarge(Img *img, int width, Options opts)
+{
+    opts.lazy = true;
+    opts.ranks = true;
+    opts.layout = LAYOUT_PLANAR;
+    Img src = *img;
+    while (src.width < width) {
+        int count = width - src.width;
+        if (count > src.width/2) count = src.width/2 > 0 ? src.width/2 : 1;
+
+        Carver c = carver_create(src, opts);
+        bool ok = carver_remove_seams(&c, count);
+        uint16_t *ranks = c.ranks;
+        c.ranks = NULL;
+        carver_destroy(&c);
+
+        Img dst = {0};
+        if (ok) {
+            dst.width = src.width + count;
+            dst.height = src.height;
+            dst.stride = dst.width;
+            dst.pixels = storage_alloc(sizeof(uint32_t)*dst.width*dst.height);
+            img_insert_seams(src, ranks, count, dst);
+        }
+        storage_free(ranks);
+        if (src.pixels != img->pixels) storage_free(src.pixels);
+        if (!ok) return false;
+        src = dst;
+    }
+    *img = src;
+    return true;
+}
+
+// Carves or stretches the width of img to width. Shrinking works in place, stretching puts
+// the result into a new buffer from storage_alloc.
+static bool carve_width(Img *img, int width, Options opts)
+{
+    if (width == img->width) return true;
+    if (width > img->width) return img_enlarge(img, width, opts);
+    Carver c = carver_create(*img, opts);
+    bool ok = carver_remove_seams(&c, img->width - width);
+    *img = carver_result(&c);
+    carver_destroy(&c);
+    return ok;
+}
+
+// What the arena has to hold for carver_create and the carve that follows it, allocation by
+// allocation. seams is how many seams the carver removes.
+static size_t carver_footprint(Options opts, int width, int height, int seams)
+{
+    size_t w = width, h = height, k = opts.seams_per_pass;
+    size_t total = 0;
+#define FOOTPRINT_ALLOC(size) (total += ((size) + ARENA_ALIGN - 1)/ARENA_ALIGN*ARENA_ALIGN)
+    if (opts.lazy && width <= IMG_LAZY_MAX_WIDTH) FOOTPRINT_ALLOC(sizeof(uint16_t)*w*h);
+    FOOTPRINT_ALLOC(sizeof(int)*h);
+    if (opts.layout == LAYOUT_AOS) {
+        FOOTPRINT_ALLOC(sizeof(Cell)*w*h);
+        FOOTPRINT_ALLOC(sizeof(float)*w);
+    } else {
+        if (opts.lum_on_demand) {
+            FOOTPRINT_ALLOC(sizeof(float)*3*w);
+            FOOTPRINT_ALLOC(sizeof(uint32_t)*w);
+        } else {
+            FOOTPRINT_ALLOC(sizeof(float)*w*h);
+        }
+        if (opts.forward) {
+            // Forward energy has neither a grad plane nor a window to compute it in
+        } else if (opts.energy == ENERGY_HALF) {
+            FOOTPRINT_ALLOC(sizeof(float)*w*h);
+            FOOTPRINT_ALLOC(sizeof(float)*((w + 1)/2 + 2)*((h + 1)/2 + 2));
+            FOOTPRINT_ALLOC(sizeof(float)*((w + 1)/2));
+        } else {
+            FOOTPRINT_ALLOC(sizeof(float)*w*h);
+            FOOTPRINT_ALLOC(sizeof(float)*4*(w + 2));
+        }
+    }
+    if (opts.pyramid > 0) {
+        size_t fw = w, fh = h;
+        for (int l = 0; l < opts.pyramid; ++l) {
+            fw = (fw + 1)/2;
+            fh = (fh + 1)/2;
+            FOOTPRINT_ALLOC(sizeof(float)*fw*fh);
+            FOOTPRINT_ALLOC(sizeof(int)*fh);
+            FOOTPRINT_ALLOC(sizeof(int)*fh);
+        }
+        FOOTPRINT_ALLOC(sizeof(float)*fw*fh);
+        FOOTPRINT_ALLOC(sizeof(float)*h*(2*opts.band + 2));
+        FOOTPRINT_ALLOC(sizeof(int)*h);
+    } else {
+        FOOTPRINT_ALLOC(sizeof(float)*w*(opts.rolling ? 2 : h));
+    }
+    if (opts.verify) FOOTPRINT_ALLOC(sizeof(float)*w*h);
+    if (opts.dirs) FOOTPRINT_ALLOC(2*((w + 7)/8)*h);
+    FOOTPRINT_ALLOC(sizeof(int)*h*k);
+    FOOTPRINT_ALLOC(sizeof(int)*k*(opts.threads > 1 ? opts.threads : 1));
+    FOOTPRINT_ALLOC(sizeof(int)*h*k);
+    FOOTPRINT_ALLOC(sizeof(int)*h*k);
+    FOOTPRINT_ALLOC(sizeof(float)*w);
+    FOOTPRINT_ALLOC(sizeof(float)*w);
+    if (k > 1) {
+        FOOTPRINT_ALLOC((w + 7)/8*h);
+        // compute_seams takes k ints of scratch on every pass, which is a seam at the least
+        for (int i = 0; i < seams; ++i) FOOTPRINT_ALLOC(sizeof(int)*k);
+    }
+    if (opts.threads > 1) {
+        // The scratch rows of the parallel dp are malloced outside of the arena, but they are
+        // memory all the same
+        FOOTPRINT_ALLOC(sizeof(double)*opts.threads);
+        FOOTPRINT_ALLOC(sizeof(float)*2*w*opts.threads);
+    }
+    if (opts.ranks) FOOTPRINT_ALLOC(sizeof(uint16_t)*w*h);
+#undef FOOTPRINT_ALLOC
+    return total;
+}
+
+// The arena footprint of carve_width. Nothing is handed back to the arena before the carve is
+// over, so every round of an enlargement adds up.
+static size_t carve_width_footprint(Options opts, int width, int height, int target_width)
+{
+    if (target_width <= width) return carver_footprint(opts, width, height, width - target_width);
+    opts.lazy = true;
+    opts.ranks = true;
+    opts.layout = LAYOUT_PLANAR;
+    size_t total = 0;
+    while (width < target_width) {
+        int count = target_width - width;
+        if (count > width/2) count = width/2 > 0 ? width/2 : 1;
+        total += carver_footprint(opts, width, height, count);
+        width += count;
+        total += ((size_t)sizeof(uint32_t)*width*height + ARENA_ALIGN - 1)/ARENA_ALIGN*ARENA_ALIGN;
+    }
+    return total;
+}
+
+// What an encoder needs no matter how small the image: the png chunks and the zlib framing or
+// the jpg headers and tables take a few KiB, and the deflate of stb_image_write keeps a hash
+// table of 16384 buckets
+#define ENCODED_OVERHEAD (4096 + 16384*sizeof(void*))
+
+// Everything seamcarver_carve_encoded holds at once for an image of file_size bytes: the
+// file, the decoded pixels, the arena and the encoder. The png encoder keeps the filtered rows
+// next to the compressed stream, which deflate can make 9/8 of them and which grows by
+// doubling, and the stream next to the file, which then goes into the output buffer that also
+// grows by doubling. Four times the filtered rows covers the worst of that as if the pixels
+// did not compress at all.
+static size_t carve_encoded_footprint(Options opts, int width, int height, int target_width, size_t file_size)
+{
+    size_t encoded = ((size_t)sizeof(uint32_t)*target_width + 1)*height;
+    return file_size + sizeof(uint32_t)*(size_t)width*height + carve_width_footprint(opts, width, height, target_width) +
+           4*encoded + ENCODED_OVERHEAD;
+}
+
+struct SeamCarver {
+    Options opts;
+    Arena arena;
+};
+
+// main picks the kernels itself and carves with the options of the command line
+static SeamCarver *seamcarver_create_with(Options opts)
+{
+    SeamCarver *ctx = calloc(1, sizeof(*ctx));
+    assert(ctx != NULL);
+    ctx->opts = opts;
+    return ctx;
+}
+
+// The library always runs the best kernels of the machine. Contexts are created from any
+// thread, so the table is filled in once.
+static pthread_once_t simd_auto_once = PTHREAD_ONCE_INIT;
+
+static void simd_select_auto(void)
+{
+    simd_select("auto");
+}
+
+SeamCarver *seamcarver_create(void)
+{
+    pthread_once(&simd_auto_once, simd_select_auto);
+    return seamcarver_create_with((Options) { .seams_per_pass = 1, .band = 2 });
+}
+
+void seamcarver_destroy(SeamCarver *ctx)
+{
+    if (ctx == NULL) return;
+    arena_destroy(&ctx->arena);
+    free(ctx);
+}
+
+bool seamcarver_carve(SeamCarver *ctx, const uint32_t *in_pixels, int width, int height, int stride,
+                      int target_width, uint32_t *out)
+{
+    if (width <= 0 || height <= 0 || target_width <= 0) return false;
+    // Only enlarging goes through the index map
+    if (target_width > width && target_width > IMG_LAZY_MAX_WIDTH) return false;
+
+    Arena *outer = storage_arena;
+    storage_arena = &ctx->arena;
+
+    // The carving works in place, so it gets a copy of the pixels
+    Img img = {
+        .pixels = storage_alloc(sizeof(uint32_t)*width*height),
+        .width = width,
+        .height = height,
+        .stride = width,
+    };
+    for (int y = 0; y < height; ++y) {
+        memcpy(&img.pixels[(size_t)y*width], &in_pixels[(size_t)y*stride], sizeof(uint32_t)*width);
+    }
+    bool ok = carve_width(&img, target_width, ctx->opts);
+    if (ok) {
+        for (int y = 0; y < height; ++y) {
+            memcpy(&out[(size_t)y*target_width], &img.pixels[(size_t)y*img.stride], sizeof(uint32_t)*target_width);
+        }
+    }
+
+    // Resetting right away grows the arena to the high-water mark of this carve, so the
+    // next one of the same size already finds everything in place
+    arena_reset(&ctx->arena);
+    storage_arena = outer;
+    return ok;
+}
+
+size_t seamcarver_high_water(const SeamCarver *ctx)
+{
+    return ctx->arena.high_water;
+}
+
+size_t seamcarver_footprint(int width, int height, int target_width, size_t file_size)
+{
+    Options opts = { .seams_per_pass = 1, .band = 2 };
+    return carve_encoded_footprint(opts, width, height, target_width, file_size);
+}
+
+bool seamcarver_info(const void *data, size_t size, int *width, int *height)
+{
+    if (size > INT_MAX) return false;
+    return stbi_info_from_memory(data, (int)size, width, height, NULL);
+}
+
+// The stb_image_write callback, which encodes straight into the buffer
+static void buffer_write(void *context, void *data, int size)
+{
+    SeamCarver_Buffer *buffer = context;
+    nob_da_append_many(buffer, (unsigned char*)data, size);
+}
+
+bool seamcarver_carve_encoded(SeamCarver *ctx, const void *data, size_t size, int target_width,
+                              SeamCarver_Format format, int quality, SeamCarver_Buffer *out)
+{
+    if (size > INT_MAX || target_width <= 0) return false;
+    int width, height;
+    if (!stbi_info_from_memory(data, (int)size, &width, &height, NULL)) return false;
+    // Only enlarging goes through the index map
+    if (target_width > width && target_width > IMG_LAZY_MAX_WIDTH) return false;
+    uint32_t *pixels = (uint32_t*)stbi_load_from_memory(data, (int)size, &width, &height, NULL, 4);
+    if (pixels == NULL) return false;
+
+    Arena *outer = storage_arena;
+    storage_arena = &ctx->arena;
+
+    // The decoded pixels are ours, so unlike seamcarver_carve this carves them in place
+    Img img = {
+        .pixels = pixels,
+        .width = width,
+        .height = height,
+        .stride = width,
+    };
+    bool ok = carve_width(&img, target_width, ctx->opts);
+    if (ok && format == SEAMCARVER_PNG) {
+        ok = stbi_write_png_to_func(buffer_write, out, img.width, img.height, 4, img.pixels, img.stride*sizeof(uint32_t));
+    } else if (ok) {
+        // The jpg writer has no stride, the carved rows are packed towards the start instead
+        for (int y = 1; y < img.height && img.stride != img.width; ++y) {
+            memmove(&img.pixels[(size_t)y*img.width], &img.pixels[(size_t)y*img.stride], sizeof(uint32_t)*img.width);
+        }
+        ok = stbi_write_jpg_to_func(buffer_write, out, img.width, img.height, 4, img.pixels, quality);
+    }
+
+    arena_reset(&ctx->arena);
+    storage_arena = outer;
+    stbi_image_free(pixels);
+    return ok;
+}
+
+#ifndef SEAMCARVE_NO_MAIN
+
+static double get_time(void)
+{
+    struct timespec tp = {0};
+    int ret = clock_gettime(CLOCK_MONOTONIC, &tp);
+    assert(ret == 0);
+    return tp.tv_sec + tp.tv_nsec*0.000000001;
+}
+
+// Below this size a block of the source and the destination fit into L1 together
+#define TRANSPOSE_BLOCK 32
+
+// Cache oblivious transpose of the block [x0, x1) x [y0, y1). Halving the longer side until
+// the block is small enough keeps both the reads and the writes local at every cache level.
+static void img_transpose_block(Img src, Img dst, int x0, int x1, int y0, int y1)
+{
+    if (x1 - x0 <= TRANSPOSE_BLOCK && y1 - y0 <= TRANSPOSE_BLOCK) {
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                dst.pixels[(size_t)x*dst.stride + y] = src.pixels[(size_t)y*src.stride + x];
+            }
+        }
+    } else if (x1 - x0 >= y1 - y0) {
+        int xm = x0 + (x1 - x0)/2;
+        img_transpose_block(src, dst, x0, xm, y0, y1);
+        img_transpose_block(src, dst, xm, x1, y0, y1);
+    } else {
+        int ym = y0 + (y1 - y0)/2;
+        img_transpose_block(src, dst, x0, x1, y0, ym);
+        img_transpose_block(src, dst, x0, x1, ym, y1);
+    }
+}
+
+// Both images have to be materialized
+static void img_transpose(Img src, Img dst)
+{
+    assert(src.index == NULL && src.offset == NULL);
+    assert(dst.index == NULL && dst.offset == NULL);
+    assert(src.width == dst.height);
+    assert(src.height == dst.width);
+    img_transpose_block(src, dst, 0, src.width, 0, src.height);
+}
+
+// Carves the image to width x height. The height is carved as the width of the transposed
+// image, so horizontal seams go through exactly the same row-major passes as the vertical
+// ones. When the image grows, the result lives in a new buffer from storage_alloc and the
+// original pixels are left alone.
+static bool carve(Img *img, int width, int height, Options opts)
+{
+    uint32_t *pixels = img->pixels;
+    if (!carve_width(img, width, opts)) return false;
+    if (img->height == height) return true;
+
+    Img transposed = {
+        .pixels = storage_alloc(sizeof(uint32_t)*img->width*img->height),
+        .width = img->height,
+        .height = img->width,
+        .stride = img->height,
+    };
+    img_transpose(*img, transposed);
+    uint32_t *transposed_pixels = transposed.pixels;
+    bool ok = carve_width(&transposed, height, opts);
+    if (transposed.pixels != transposed_pixels) storage_free(transposed_pixels);
+
+    if (height > img->height) {
+        uint32_t *taller = storage_alloc(sizeof(uint32_t)*img->width*height);
+        if (img->pixels != pixels) storage_free(img->pixels);
+        img->pixels = taller;
+    }
+    img->width = transposed.height;
+    img->height = transposed.width;
+    img->stride = img->width;
+    img_transpose(transposed, *img);
+    storage_free(transposed.pixels);
+    return ok;
+}
+
+// The reference conversion and full frame filters the benchmarks check the kernels against
+
+// https://stackoverflow.com/questions/596216/formula-to-determine-perceived-brightness-of-rgb-color
+static float rgb_to_lum(uint32_t rgb)
+{
+    float r = ((rgb >> (8*0)) & 0xFF)/255.0;
+    float g = ((rgb >> (8*1)) & 0xFF)/255.0;
+    float b = ((rgb >> (8*2)) & 0xFF)/255.0;
+    return 0.2126*r + 0.7152*g + 0.0722*b;
+}
+
+static float sobel_filter_at(Mat mat, int cx, int cy)
+{
+    float c[3][3];
+    for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+            int x = cx + dx;
+            int y = cy + dy;
+            c[dy + 1][dx + 1] = MAT_WITHIN(mat, y, x) ? MAT_AT(mat, y, x) : 0.0;
+        }
+    }
+    return sobel(c);
+}
+
+// The full frame stencil goes over a copy of lum with a guard row and column of zeros on every
+// side, so every cell goes through the span kernel without a single bounds check
+static void stencil_filter(Mat mat, Mat grad, Energy energy)
+{
+    assert(mat.width == grad.width);
+    assert(mat.height == grad.height);
+
+    Mat padded = mat_alloc(mat.width + 2, mat.height + 2);
+    memset(&MAT_AT(padded, 0, 0), 0, padded.width*sizeof(float));
+    for (int y = 0; y < mat.height; ++y) {
+        float *row = &MAT_AT(padded, y + 1, 0);
+        row[0] = 0.0;
+        memcpy(row + 1, &MAT_AT(mat, y, 0), mat.width*sizeof(float));
+        row[mat.width + 1] = 0.0;
+    }
+    memset(&MAT_AT(padded, mat.height + 1, 0), 0, padded.width*sizeof(float));
+
+    Stencil_Span span = energy_span(energy);
+    for (int y = 0; y < mat.height; ++y) {
+        // Shifting the rows by the guard column lines them up with the columns of grad
+        span(&MAT_AT(padded, y, 1), &MAT_AT(padded, y + 1, 1), &MAT_AT(padded, y + 2, 1),
+             &MAT_AT(grad, y, 0), 0, mat.width);
+    }
+    storage_free(padded.items);
+}
+
+static void energy_filter(Mat mat, Mat grad, Energy energy)
+{
+    if (energy == ENERGY_HALF) {
+        half_filter(mat, grad);
+    } else {
+        stencil_filter(mat, grad, energy);
+    }
+}
+
+static const char *energy_names[] = {"sobel", "e1", "scharr", "half"};
+
+#define BENCH_REPEATS 20
+
+// Both conversion modes against the reference rgb_to_lum
+static void bench_lum(Img img)
+{
+    printf("luminance %dx%d, %s kernels\n", img.width, img.height, simd.name);
+    Mat reference = mat_alloc(img.width, img.height);
+    Mat lum = mat_alloc(img.width, img.height);
+
+    double begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) {
+        for (int y = 0; y < img.height; ++y) {
+            for (int x = 0; x < img.width; ++x) {
+                MAT_AT(reference, y, x) = rgb_to_lum(IMG_AT(img, y, x));
+            }
+        }
+    }
+    double scalar = (get_time() - begin)/BENCH_REPEATS;
+    printf("    reference   %8.3lfms\n", scalar*1000);
+
+    static const char *names[] = {
+        [LUM_EXACT] = "exact",
+        [LUM_FIXED] = "fixed",
+    };
+    for (size_t mode = 0; mode < NOB_ARRAY_LEN(names); ++mode) {
+        begin = get_time();
+        for (int i = 0; i < BENCH_REPEATS; ++i) luminance(img, lum, mode);
+        double elapsed = (get_time() - begin)/BENCH_REPEATS;
+        size_t mismatches = 0;
+        float error = 0;
+        for (int y = 0; y < img.height; ++y) {
+            for (int x = 0; x < img.width; ++x) {
+                float d = fabsf(MAT_AT(lum, y, x) - MAT_AT(reference, y, x));
+                if (d != 0) mismatches += 1;
+                if (d > error) error = d;
+            }
+        }
+        printf("    %-10s  %8.3lfms  %5.2lfx  %zu mismatches, max error %g\n", names[mode], elapsed*1000, scalar/elapsed, mismatches, error);
+    }
+    storage_free(reference.items);
+    storage_free(lum.items);
+}
+
+// The padded full frame pass against the per cell gather it replaced, and the fused pass
+// against the separate luminance and sobel passes
+static void bench_sobel(Img img, Mat lum, Mat grad)
+{
+    printf("sobel_filter %dx%d, %s kernels\n", lum.width, lum.height, simd.name);
+
+    double begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) {
+        for (int cy = 0; cy < lum.height; ++cy) {
+            for (int cx = 0; cx < lum.width; ++cx) {
+                MAT_AT(grad, cy, cx) = sobel_filter_at(lum, cx, cy);
+            }
+        }
+    }
+    double gather = (get_time() - begin)/BENCH_REPEATS;
+    printf("    gather      %8.3lfms\n", gather*1000);
+
+    begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) stencil_filter(lum, grad, ENERGY_SOBEL);
+    double padded = (get_time() - begin)/BENCH_REPEATS;
+    printf("    padded      %8.3lfms  %5.2lfx\n", padded*1000, gather/padded);
+
+    begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) {
+        luminance(img, lum, LUM_EXACT);
+        stencil_filter(lum, grad, ENERGY_SOBEL);
+    }
+    double elapsed = (get_time() - begin)/BENCH_REPEATS;
+    printf("    lum+sobel   %8.3lfms\n", elapsed*1000);
+    begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) luminance_energy(img, (Mat){0}, grad, LUM_EXACT, ENERGY_SOBEL);
+    elapsed = (get_time() - begin)/BENCH_REPEATS;
+    printf("    fused       %8.3lfms  %6.1lfMB less\n", elapsed*1000, sizeof(float)*lum.width*lum.height/1e6);
+
+    // The other energies over the same lum, against the padded sobel pass
+    for (Energy energy = ENERGY_E1; energy <= ENERGY_HALF; ++energy) {
+        begin = get_time();
+        for (int i = 0; i < BENCH_REPEATS; ++i) energy_filter(lum, grad, energy);
+        elapsed = (get_time() - begin)/BENCH_REPEATS;
+        printf("    %-11s %8.3lfms  %5.2lfx of sobel\n", energy_names[energy], elapsed*1000, elapsed/padded);
+    }
+}
+
+static void bench_dp(Mat lum, Mat grad, int max_threads)
+{
+    Mat dp = mat_alloc(grad.width, grad.height);
+    printf("grad_to_dp %dx%d, %s kernels\n", grad.width, grad.height, simd.name);
+
+    double begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) grad_to_dp(grad, dp);
+    double serial = (get_time() - begin)/BENCH_REPEATS;
+    printf("    serial      %8.3lfms  %6.1lfMB\n", serial*1000, sizeof(float)*grad.width*grad.height/1e6);
+
+    begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) lum_to_dp_forward(lum, dp);
+    double elapsed = (get_time() - begin)/BENCH_REPEATS;
+    printf("    forward     %8.3lfms  %5.2lfx of serial\n", elapsed*1000, elapsed/serial);
+
+    Dirs dirs = dirs_alloc(grad.width, grad.height);
+    Mat rolling = mat_alloc(grad.width, 2);
+    begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) grad_to_dp_dirs(grad, dp, dirs);
+    elapsed = (get_time() - begin)/BENCH_REPEATS;
+    printf("    dirs        %8.3lfms  %6.1lfMB\n", elapsed*1000, (sizeof(float)*grad.width*grad.height + 2.0*dirs.stride*grad.height)/1e6);
+    begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) grad_to_dp_dirs(grad, rolling, dirs);
+    elapsed = (get_time() - begin)/BENCH_REPEATS;
+    printf("    rolling     %8.3lfms  %6.1lfMB\n", elapsed*1000, (sizeof(float)*grad.width*2 + 2.0*dirs.stride*grad.height)/1e6);
+    storage_free(dirs.bits);
+    storage_free(rolling.items);
+
+    for (int threads = 1;; threads *= 2) {
+        if (threads > max_threads) threads = max_threads;
+        Parallel_Dp pdp = parallel_dp_create(threads, grad.width);
+        begin = get_time();
+        for (int i = 0; i < BENCH_REPEATS; ++i) grad_to_dp_parallel(&pdp, grad, dp, (Dirs){0});
+        elapsed = (get_time() - begin)/BENCH_REPEATS;
+        printf("    %2d threads  %8.3lfms  %5.2lfx\n", threads, elapsed*1000, serial/elapsed);
+        parallel_dp_destroy(pdp);
+        if (threads == max_threads) break;
+    }
+    storage_free(dp.items);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [OPTIONS] <input> <output>\n", program);
+    fprintf(stderr, "       %s --bench [OPTIONS] <input>\n", program);
+    fprintf(stderr, "       %s --batch [OPTIONS] <input-dir> <output-dir>\n", program);
+    fprintf(stderr, "OPTIONS:\n");
+    fprintf(stderr, "    --width <w,...>  carve the width to w, two thirds of the width are removed by default\n");
+    fprintf(stderr, "                     a width above the original duplicates the lowest energy seams\n");
+    fprintf(stderr, "    --scale <s,...>  carve the width down to s times the width\n");
+    fprintf(stderr, "                     with several widths every one of them is written to <output>-<width>.png\n");
+    fprintf(stderr, "    --height <h>     carve the height to h with horizontal seams\n");
+    fprintf(stderr, "    --incremental    update the cumulative energy only around the removed seam\n");
+    fprintf(stderr, "    --verify         check every incremental update against the full recompute\n");
+    fprintf(stderr, "    --simd <name>    auto (default), scalar, sse2, avx2 or avx512\n");
+    fprintf(stderr, "    --threads <n>    compute the cumulative energy on n threads\n");
+    fprintf(stderr, "    --dirs           record the seam directions and follow them instead of dp\n");
+    fprintf(stderr, "    --rolling        like --dirs, but keep only two rows of the cumulative energy\n");
+    fprintf(stderr, "    --seams-per-pass <k>\n");
+    fprintf(stderr, "                     remove up to k disjoint seams found in one cumulative energy\n");
+    fprintf(stderr, "    --lazy           carve per row maps of column indices and gather the pixels once at the end\n");
+    fprintf(stderr, "    --layout <name>  planar (default) or aos to keep pixel, lum and grad interleaved\n");
+    fprintf(stderr, "    --lum <mode>     exact (default) to match the reference conversion bit for bit or fixed for integer weights\n");
+    fprintf(stderr, "    --energy <name>  sobel (default), e1 for the absolute differences of the neighbours, scharr,\n");
+    fprintf(stderr, "                     or half for the sobel energy of the image at half resolution\n");
+    fprintf(stderr, "    --forward        use forward energy, the cost of the edges a seam creates instead of the pixels it removes\n");
+    fprintf(stderr, "    --pyramid <n>    find the seams on n coarser levels first and refine them in a band\n");
+    fprintf(stderr, "    --band <b>       columns on both sides of the coarse seam to search at a finer level, 2 by default\n");
+    fprintf(stderr, "    --write-index <path>\n");
+    fprintf(stderr, "                     save the order in which every pixel is carved away, then write the output from it\n");
+    fprintf(stderr, "    --from-index <path>\n");
+    fprintf(stderr, "                     write the output straight from a saved index without carving\n");
+    fprintf(stderr, "    --scratch-dir <dir>\n");
+    fprintf(stderr, "                     keep the image and the energy planes in memory mapped files in dir instead of RAM\n");
+    fprintf(stderr, "    --lum-on-demand  drop the lum plane and recompute lum from the pixels around every seam\n");
+    fprintf(stderr, "    --batch          <input> and <output> are directories and every image of input is carved into output\n");
+    fprintf(stderr, "    --jobs <n>       carve n images of a batch at a time, one per core by default\n");
+    fprintf(stderr, "    --schedule-log <path>\n");
+    fprintf(stderr, "                     write the cost, the threads and the timing of every image of a batch to path\n");
+    fprintf(stderr, "    --max-mem <size> only carve as many images of a batch at once as fit into size, like 512M or 8G\n");
+    fprintf(stderr, "    --bench          time the stages and layouts on the input instead of carving it\n");
+}
+
+static int missing_value(const char *program, const char *option)
+{
+    usage(program);
+    fprintf(stderr, "ERROR: no value is provided for %s\n", option);
+    return 1;
+}
+
+// Copies what the carver has got so far into out, which has to be big enough for the
+// original image, without disturbing the carving
+static void carver_snapshot(Carver *c, Img *out)
+{
+    out->width = c->img.width;
+    out->height = c->img.height;
+    out->stride = out->width;
+    out->index = NULL;
+    out->offset = NULL;
+    for (int y = 0; y < out->height; ++y) {
+        uint32_t *pixel_row = &out->pixels[(size_t)y*out->stride];
+        for (int x = 0; x < out->width; ++x) {
+            pixel_row[x] = c->opts.layout == LAYOUT_AOS ? CELLS_AT(c->cells, y, x).pixel : IMG_AT(c->img, y, x);
+        }
+    }
+}
+
+static bool write_output(Img img, const char *path)
+{
+    if (!stbi_write_png(path, img.width, img.height, 4, img.pixels, img.stride*sizeof(uint32_t))) {
+        fprintf(stderr, "ERROR: could not save file %s\n", path);
+        return false;
+    }
+    printf("OK: generated %s\n", path);
+    return true;
+}
+
+// The retarget index stores the seam that removed every pixel, so any narrower width is a
+// single pass over the image that keeps the pixels removed by none of the first seams. The
+// header is followed by width*height uint16 ranks in the byte order of the host.
+typedef struct {
+    char magic[4];
+    uint32_t width;
+    uint32_t height;
+} Index_Header;
+
+#define INDEX_MAGIC "SCRI"
+
+static bool index_save(const char *path, const uint16_t *ranks, int width, int height)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    Index_Header header = { .width = width, .height = height };
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(ranks, sizeof(*ranks)*width, height, f) == (size_t)height;
+    if (fclose(f) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not write %s\n", path);
+        return false;
+    }
+    printf("OK: generated %s\n", path);
+    return true;
+}
+
+// Returns NULL when the file is not an index of a width x height image
+static uint16_t *index_load(const char *path, int width, int height)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    Index_Header header;
+    uint16_t *ranks = NULL;
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not a retarget index\n", path);
+    } else if (header.width != (uint32_t)width || header.height != (uint32_t)height) {
+        fprintf(stderr, "ERROR: %s indexes a %ux%u image, not %dx%d\n", path, header.width, header.height, width, height);
+    } else {
+        ranks = storage_alloc(sizeof(*ranks)*width*height);
+        if (fread(ranks, sizeof(*ranks)*width, height, f) != (size_t)height) {
+            fprintf(stderr, "ERROR: %s is truncated\n", path);
+            storage_free(ranks);
+            ranks = NULL;
+        }
+    }
+    fclose(f);
+    return ranks;
+}
+
+// Gathers the pixels of src that survive the first src.width - width seams into dst, which
+// has to be as big as src. Every row is written branch free, a kept pixel just advances the
+// cursor.
+static void img_retarget(Img src, const uint16_t *ranks, int width, Img *dst)
+{
+    int removed = src.width - width;
+    dst->width = width;
+    dst->height = src.height;
+    dst->stride = width;
+    dst->index = NULL;
+    dst->offset = NULL;
+    for (int y = 0; y < src.height; ++y) {
+        const uint32_t *pixel_row = &src.pixels[(size_t)y*src.stride];
+        const uint16_t *rank_row = &ranks[(size_t)y*src.width];
+        // Writing one past the end of the row only ever touches the next row, which has not
+        // been gathered yet, or the slack at the end of dst
+        uint32_t *out = &dst->pixels[(size_t)y*dst->stride];
+        int n = 0;
+        for (int x = 0; x < src.width; ++x) {
+            out[n] = pixel_row[x];
+            n += rank_row[x] >= removed;
+        }
+        assert(n == width);
+    }
+}
+
+// out.png becomes out-<width>.png
+static const char *output_path_with_width(const char *path, int width)
+{
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    if (dot == NULL || (slash != NULL && dot < slash)) return nob_temp_sprintf("%s-%d", path, width);
+    return nob_temp_sprintf("%.*s-%d%s", (int)(dot - path), path, width, dot);
+}
+
+// Carves the image through the widths, which are sorted widest first, and writes every one of
+// them as soon as the carver gets there. All the outputs share the seams of the wider ones,
+// so the whole run costs about as much as carving the narrowest width alone.
+static bool carve_widths(Img img, const int *widths, size_t count, int height, Options opts, const char *out_file_path)
+{
+    uint32_t *pixels = storage_alloc(sizeof(uint32_t)*img.width*img.height);
+    Carver c = carver_create(img, opts);
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; ++i) {
+        ok = carver_remove_seams(&c, c.img.width - widths[i]);
+        if (!ok) break;
+        Img out = { .pixels = pixels };
+        carver_snapshot(&c, &out);
+        if (height != out.height) ok = carve(&out, out.width, height, opts);
+        if (ok) ok = write_output(out, output_path_with_width(out_file_path, widths[i]));
+        // A taller output does not fit into the snapshot
+        if (out.pixels != pixels) storage_free(out.pixels);
+    }
+    carver_destroy(&c);
+    storage_free(pixels);
+    return ok;
+}
+
+// Serves the widths from the retarget index in read_path, or computes the index first by
+// carving all the way down to a single column and saves it to write_path
+static bool retarget_widths(Img img, const int *widths, size_t count, Options opts,
+                            const char *read_path, const char *write_path, const char *out_file_path)
+{
+    uint16_t *ranks;
+    if (read_path != NULL) {
+        ranks = index_load(read_path, img.width, img.height);
+        if (ranks == NULL) return false;
+    } else {
+        opts.lazy = true;
+        opts.ranks = true;
+        Carver c = carver_create(img, opts);
+        bool ok = carver_remove_seams(&c, img.width - 1);
+        ranks = c.ranks;
+        c.ranks = NULL;
+        carver_destroy(&c);
+        if (!ok || !index_save(write_path, ranks, img.width, img.height)) {
+            storage_free(ranks);
+            return false;
+        }
+    }
+
+    Img out = { .pixels = storage_alloc(sizeof(uint32_t)*img.width*img.height) };
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; ++i) {
+        img_retarget(img, ranks, widths[i], &out);
+        ok = write_output(out, count > 1 ? output_path_with_width(out_file_path, widths[i]) : out_file_path);
+    }
+    storage_free(out.pixels);
+    storage_free(ranks);
+    return ok;
+}
+
+// The blocked transpose against the naive one
+static void bench_transpose(Img img)
+{
+    Img dst = {
+        .pixels = malloc(sizeof(uint32_t)*img.width*img.height),
+        .width = img.height,
+        .height = img.width,
+        .stride = img.height,
+    };
+    assert(dst.pixels != NULL);
+    printf("transpose %dx%d\n", img.width, img.height);
+
+    double begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) {
+        for (int y = 0; y < img.height; ++y) {
+            for (int x = 0; x < img.width; ++x) {
+                dst.pixels[x*dst.stride + y] = img.pixels[y*img.stride + x];
+            }
+        }
+    }
+    double naive = (get_time() - begin)/BENCH_REPEATS;
+    printf("    naive       %8.3lfms\n", naive*1000);
+
+    begin = get_time();
+    for (int i = 0; i < BENCH_REPEATS; ++i) img_transpose(img, dst);
+    double elapsed = (get_time() - begin)/BENCH_REPEATS;
+    printf("    blocked     %8.3lfms  %5.2lfx\n", elapsed*1000, naive/elapsed);
+    free(dst.pixels);
+}
+
+// Carves the same seams exactly and through pyramids of a few depths and bands, and compares
+// the energy of everything they removed
+static void bench_pyramid(Img img, int seams)
+{
+    static const struct { int levels, band; } configs[] = {
+        {0, 0}, {1, 2}, {2, 2}, {3, 2}, {2, 8}, {3, 8},
+    };
+    printf("pyramid seam search, %d seams out of %dx%d\n", seams, img.width, img.height);
+    size_t size = sizeof(uint32_t)*img.stride*img.height;
+    uint32_t *pixels = malloc(size);
+    assert(pixels != NULL);
+    double exact = 0;
+    for (size_t i = 0; i < NOB_ARRAY_LEN(configs); ++i) {
+        memcpy(pixels, img.pixels, size);
+        Img copy = img;
+        copy.pixels = pixels;
+        Options opts = { .seams_per_pass = 1, .pyramid = configs[i].levels, .band = configs[i].band };
+        double begin = get_time();
+        Carver c = carver_create(copy, opts);
+        carver_remove_seams(&c, seams);
+        double elapsed = get_time() - begin;
+        if (i == 0) exact = c.energy;
+        if (configs[i].levels == 0) {
+            printf("    exact               %8.3lfms  %6.3lfms/seam  energy %.1lf\n", elapsed*1000, elapsed*1000/seams, c.energy);
+        } else {
+            printf("    %d levels, band %-2d  %8.3lfms  %6.3lfms/seam  energy %.1lf  %+.2lf%%\n", configs[i].levels, configs[i].band,
+                   elapsed*1000, elapsed*1000/seams, c.energy, (c.energy/exact - 1)*100);
+        }
+        carver_destroy(&c);
+    }
+    free(pixels);
+}
+
+// Carves the same seams with both layouts
+static void bench_layouts(Img img, int seams)
+{
+    static const char *names[] = {
+        [LAYOUT_PLANAR] = "planar",
+        [LAYOUT_AOS] = "aos",
+    };
+    printf("carving %d seams out of %dx%d\n", seams, img.width, img.height);
+    size_t size = sizeof(uint32_t)*img.stride*img.height;
+    uint32_t *pixels = malloc(size);
+    assert(pixels != NULL);
+    for (size_t layout = 0; layout < NOB_ARRAY_LEN(names); ++layout) {
+        memcpy(pixels, img.pixels, size);
+        Img copy = img;
+        copy.pixels = pixels;
+        Options opts = { .seams_per_pass = 1, .layout = layout };
+        double begin = get_time();
+        Carver c = carver_create(copy, opts);
+        carver_remove_seams(&c, seams);
+        double elapsed = get_time() - begin;
+        printf("    %-10s  %8.3lfms  %6.3lfms/seam\n", names[layout], elapsed*1000, elapsed*1000/seams);
+        carver_destroy(&c);
+    }
+    free(pixels);
+}
+
+typedef struct {
+    double *items;
+    size_t count;
+    size_t capacity;
+} Numbers;
+
+typedef struct {
+    int *items;
+    size_t count;
+    size_t capacity;
+} Widths;
+
+// Parses a comma separated list of numbers like 800,600,400
+static bool parse_numbers(const char *arg, Numbers *numbers)
+{
+    char *end;
+    do {
+        double value = strtod(arg, &end);
+        if (end == arg) return false;
+        nob_da_append(numbers, value);
+        arg = end + 1;
+    } while (*end == ',');
+    return *end == '\0';
+}
+
+// Parses a size in bytes like 512M or 8G, the suffixes are powers of 1024
+static bool parse_size(const char *arg, size_t *size)
+{
+    static const char suffixes[] = "KMGT";
+    char *end;
+    double value = strtod(arg, &end);
+    if (end == arg) return false;
+    if (*end != '\0') {
+        const char *suffix = strchr(suffixes, toupper((unsigned char)*end));
+        if (suffix == NULL || end[1] != '\0') return false;
+        value *= pow(1024, suffix - suffixes + 1);
+    }
+    if (!(value >= 1 && value <= (double)SIZE_MAX)) return false;
+    *size = (size_t)value;
+    return true;
+}
+
+// Formats a size in bytes with the suffixes of parse_size, like 6.3MiB
+static const char *format_size(double size)
+{
+    static const char suffixes[] = "KMGT";
+    if (size < 1024) return nob_temp_sprintf("%.0lfB", size);
+    int i = 0;
+    for (size /= 1024; size >= 1024 && i + 1 < (int)strlen(suffixes); size /= 1024) i += 1;
+    return nob_temp_sprintf("%.1lf%ciB", size, suffixes[i]);
+}
+
+static int compare_widths_desc(const void *a, const void *b)
+{
+    return *(const int*)b - *(const int*)a;
+}
+
+#define BATCH_JPG_QUALITY 90
+
+typedef struct {
+    char *in_path;
+    char *out_path;
+    SeamCarver_Format format;
+    int width, height; // from the header of the file, 0 when stb_image does not know it
+    double cost; // the seams to carve times the pixels every one of them goes over
+    int threads; // the image is carved alone on this many threads, 1 when it shares a worker
+    int worker; // the worker that carved it, -1 for all of them
+    size_t size; // of the file
+    size_t footprint; // the estimated peak memory of carving it, see carve_encoded_footprint
+    size_t arena_footprint; // the part of footprint in the arena of the carver
+    size_t measured; // the same peak as it turned out, in the buffers the batch can see
+    double wait; // for the memory budget
+    double start, end; // since the start of the batch
+    double latency;
+    bool ok;
+} Batch_Item;
+
+typedef struct {
+    Batch_Item *items;
+    size_t count;
+    size_t capacity;
+    double scale; // the target width relative to the width of every image, 0 for the default
+    SeamCarver **carvers; // one per worker, each with an arena of its own
+    size_t next; // the first item that no worker has taken yet
+    double begin;
+    size_t budget; // the bytes the workers may hold at once, 0 for no limit
+    size_t reserved; // the footprints of the carves in flight and the arenas the workers keep
+    size_t reserved_peak;
+    size_t admitted; // the next item to admit, the budget lets the items in in order
+    size_t *held; // the block of the arena of every worker, which is part of reserved
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+} Batch;
+
+static char *batch_path(const char *dir, const char *name, int name_length, const char *ext)
+{
+    size_t size = strlen(dir) + 1 + name_length + strlen(ext) + 1;
+    char *path = malloc(size);
+    assert(path != NULL);
+    snprintf(path, size, "%s/%.*s%s", dir, name_length, name, ext);
+    return path;
+}
+
+static int batch_target_width(const Batch *batch, int width)
+{
+    if (batch->scale == 0) return width - width*2/3;
+    int target = (int)(width*batch->scale + 0.5);
+    return target > 0 ? target : 1;
+}
+
+// The file contents and the encoded output go through buffers of the caller that only grow,
+// and the carve itself through the arena of the carver, which is reset after every image
+static void batch_carve(Batch *batch, Batch_Item *item, SeamCarver *ctx, Nob_String_Builder *in, SeamCarver_Buffer *out)
+{
+    double begin = get_time();
+    in->count = 0;
+    out->count = 0;
+    int width, height;
+    item->ok = nob_read_entire_file(item->in_path, in) && seamcarver_info(in->items, in->count, &width, &height);
+    if (item->ok) {
+        item->ok = seamcarver_carve_encoded(ctx, in->items, in->count, batch_target_width(batch, width),
+                                            item->format, BATCH_JPG_QUALITY, out);
+    }
+    if (item->ok) {
+        item->measured = in->count + sizeof(uint32_t)*width*height + ctx->arena.last_demand + out->count;
+        item->ok = nob_write_entire_file(item->out_path, out->items, out->count);
+    }
+    double end = get_time();
+    item->start = begin - batch->begin;
+    item->end = end - batch->begin;
+    item->latency = end - begin;
+}
+
+// Gives the block back between two carves. The next carve starts over from allocations of its
+// own and the reset after it makes a block just big enough for it.
+static void arena_trim(Arena *arena)
+{
+    assert(arena->overflow.count == 0);
+    free(arena->base);
+    arena->base = NULL;
+    arena->capacity = 0;
+    arena->used = 0;
+}
+
+// What carving the item adds to reserved on a worker that already holds an arena of held
+// bytes. The carve reuses that block, so only the part of the arena beyond it counts.
+static size_t batch_demand(const Batch_Item *item, size_t held)
+{
+    size_t arena = item->arena_footprint > held ? item->arena_footprint - held : 0;
+    return item->footprint - item->arena_footprint + arena;
+}
+
+// Gives the arena of the worker back to the budget. Must be called with the lock held.
+static void batch_drop_arena(Batch *batch, int worker)
+{
+    if (batch->held[worker] == 0) return;
+    arena_trim(&batch->carvers[worker]->arena);
+    batch->reserved -= batch->held[worker];
+    batch->held[worker] = 0;
+    pthread_cond_broadcast(&batch->freed);
+}
+
+// Waits until the item is the next one in line and its footprint fits into the budget next
+// to everything reserved already. An item that does not fit into the budget at all waits
+// until nothing else is reserved and then runs alone. A worker that has to wait gives its
+// arena back first, so idle arenas never keep the item in line from fitting.
+static void batch_admit(Batch *batch, int worker, size_t i)
+{
+    Batch_Item *item = &batch->items[i];
+    double begin = get_time();
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        size_t held = batch->held[worker];
+        bool alone = batch->reserved == held;
+        if (batch->admitted == i && (alone || batch->reserved + batch_demand(item, held) <= batch->budget)) break;
+        batch_drop_arena(batch, worker);
+        pthread_cond_wait(&batch->freed, &batch->lock);
+    }
+    batch->reserved += batch_demand(item, batch->held[worker]);
+    if (batch->reserved > batch->reserved_peak) batch->reserved_peak = batch->reserved;
+    batch->admitted += 1;
+    pthread_cond_broadcast(&batch->freed);
+    pthread_mutex_unlock(&batch->lock);
+    item->wait = get_time() - begin;
+}
+
+// Takes back what batch_admit reserved for the item, except for the arena the worker keeps.
+// The worker has to have freed its file and output buffers already.
+static void batch_release(Batch *batch, int worker, size_t i)
+{
+    pthread_mutex_lock(&batch->lock);
+    batch->reserved -= batch_demand(&batch->items[i], batch->held[worker]);
+    batch->reserved -= batch->held[worker];
+    batch->held[worker] = batch->carvers[worker]->arena.capacity;
+    batch->reserved += batch->held[worker];
+    pthread_cond_broadcast(&batch->freed);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Every worker keeps taking the next image until there are none left. The items are sorted
+// by cost, so this hands the most expensive image left to whichever worker frees up first.
+static void batch_worker(Pool *pool, void *arg, int index)
+{
+    (void)pool;
+    Batch *batch = arg;
+    Nob_String_Builder in = {0};
+    SeamCarver_Buffer out = {0};
+    for (;;) {
+        size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count) break;
+        batch->items[i].worker = index;
+        if (batch->budget > 0) batch_admit(batch, index, i);
+        batch_carve(batch, &batch->items[i], batch->carvers[index], &in, &out);
+        if (batch->budget > 0) {
+            // Only the arena outlives an image under a budget, the buffers would not be accounted for
+            free(in.items);
+            free(out.items);
+            in = (Nob_String_Builder) {0};
+            out = (SeamCarver_Buffer) {0};
+            batch_release(batch, index, i);
+        }
+    }
+    if (batch->budget > 0) {
+        pthread_mutex_lock(&batch->lock);
+        batch_drop_arena(batch, index);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    free(in.items);
+    free(out.items);
+}
+
+static int compare_items_by_cost_desc(const void *a, const void *b)
+{
+    double x = ((const Batch_Item*)a)->cost;
+    double y = ((const Batch_Item*)b)->cost;
+    return (x < y) - (x > y);
+}
+
+// Every seam goes over all the pixels of the image, so an image costs the seams to carve
+// times its pixels, W^2 H at a fixed scale. Running the images largest first on whichever
+// worker is free keeps the workers within the cost of one image of each other, which is the
+// LPT bound. An image that costs more than a worker's fair share breaks that bound on its own,
+// so those are carved one at a time on all the threads with the parallel dp and removal
+// instead. Returns how many images are carved that way, they are at the front of the items.
+// The footprint of every image is estimated from its header too, with the threads it gets.
+static size_t batch_schedule(Batch *batch, int jobs, bool parallel, Options opts)
+{
+    double total = 0;
+    for (size_t i = 0; i < batch->count; ++i) {
+        Batch_Item *item = &batch->items[i];
+        if (stbi_info(item->in_path, &item->width, &item->height, NULL)) {
+            int seams = abs(item->width - batch_target_width(batch, item->width));
+            item->cost = (double)seams*item->width*item->height;
+        }
+        total += item->cost;
+    }
+    qsort(batch->items, batch->count, sizeof(*batch->items), compare_items_by_cost_desc);
+
+    size_t large = 0;
+    for (size_t i = 0; i < batch->count; ++i) {
+        Batch_Item *item = &batch->items[i];
+        if (parallel && jobs > 1 && item->cost > total/jobs) {
+            item->threads = jobs;
+            item->worker = -1;
+            large += 1;
+        } else {
+            item->threads = 1;
+        }
+        struct stat st;
+        if (stat(item->in_path, &st) == 0) item->size = st.st_size;
+        Options item_opts = opts;
+        item_opts.threads = item->threads;
+        int target_width = batch_target_width(batch, item->width);
+        item->arena_footprint = carve_width_footprint(item_opts, item->width, item->height, target_width);
+        item->footprint = carve_encoded_footprint(item_opts, item->width, item->height, target_width, item->size);
+    }
+    return large;
+}
+
+static bool batch_write_log(const Batch *batch, const char *path, int jobs, size_t large)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    fprintf(f, "# %zu images, %zu of them alone on %d threads, the rest largest first on %d workers\n",
+            batch->count, large, jobs, jobs);
+    fprintf(f, "# measured is the file, the pixels, the arena and the output, without the buffers inside the\n");
+    fprintf(f, "# encoder that footprint allows for\n");
+    fprintf(f, "# order cost width height threads worker footprint measured wait_ms start_ms end_ms ok path\n");
+    for (size_t i = 0; i < batch->count; ++i) {
+        const Batch_Item *item = &batch->items[i];
+        fprintf(f, "%zu %.0lf %d %d %d %d %zu %zu %.3lf %.3lf %.3lf %d %s\n", i, item->cost, item->width, item->height,
+                item->threads, item->worker, item->footprint, item->measured, item->wait*1000,
+                item->start*1000, item->end*1000, item->ok, item->in_path);
+    }
+    fclose(f);
+    return true;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// The nearest rank percentile of sorted values
+static double percentile(const double *sorted, size_t count, double p)
+{
+    size_t rank = (size_t)ceil(p*count);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Carves every regular file of in_dir into out_dir on jobs workers. jpg and png files keep
+// their names, everything else is written as png under its name with .png appended, so a.bmp
+// and a.png do not end up in the same file. The schedule is written to log_path when it is not NULL.
+// With a budget, the workers only carve as many images at once as their footprints fit into.
+static bool batch_run(const char *in_dir, const char *out_dir, double scale, int jobs, size_t budget, Options opts,
+                      const char *log_path)
+{
+    // jpg and png outputs have the names of their inputs, so carving into the input directory
+    // would replace the originals. An output directory that does not exist yet cannot be it.
+    char *in_real = realpath(in_dir, NULL);
+    char *out_real = realpath(out_dir, NULL);
+    bool same = in_real != NULL && out_real != NULL && strcmp(in_real, out_real) == 0;
+    free(in_real);
+    free(out_real);
+    if (same) {
+        fprintf(stderr, "ERROR: %s and %s are the same directory, the outputs would replace the inputs\n", in_dir, out_dir);
+        return false;
+    }
+
+    Nob_File_Paths children = {0};
+    if (!nob_read_entire_dir(in_dir, &children)) return false;
+    qsort(children.items, children.count, sizeof(*children.items), compare_strings);
+
+    Batch batch = { .scale = scale, .budget = budget };
+    bool clash = false;
+    for (size_t i = 0; i < children.count; ++i) {
+        const char *name = children.items[i];
+        if (name[0] == '.') continue;
+        char *in_path = batch_path(in_dir, name, strlen(name), "");
+        if (nob_get_file_type(in_path) != NOB_FILE_REGULAR) {
+            free(in_path);
+            continue;
+        }
+        const char *dot = strrchr(name, '.');
+        bool jpg = dot != NULL && (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0);
+        bool png = dot != NULL && strcasecmp(dot, ".png") == 0;
+        if (!jpg && !png) {
+            // a.bmp still clashes with an a.bmp.png next to it
+            const char *renamed = nob_temp_sprintf("%s.png", name);
+            if (bsearch(&renamed, children.items, children.count, sizeof(*children.items), compare_strings) != NULL) {
+                fprintf(stderr, "ERROR: %s/%s and %s/%s would both be carved into %s/%s\n",
+                        in_dir, name, in_dir, renamed, out_dir, renamed);
+                clash = true;
+            }
+        }
+        Batch_Item item = {
+            .in_path = in_path,
+            .out_path = batch_path(out_dir, name, strlen(name), jpg || png ? "" : ".png"),
+            .format = jpg ? SEAMCARVER_JPG : SEAMCARVER_PNG,
+        };
+        nob_da_append(&batch, item);
+    }
+    free(children.items);
+    if (clash) {
+        for (size_t i = 0; i < batch.count; ++i) {
+            free(batch.items[i].in_path);
+            free(batch.items[i].out_path);
+        }
+        free(batch.items);
+        return false;
+    }
+    if (batch.count == 0) {
+        fprintf(stderr, "ERROR: no files to carve in %s\n", in_dir);
+        return false;
+    }
+    if (!nob_mkdir_if_not_exists(out_dir)) return false;
+
+    // The parallel dp does not work with the modes that search the seams their own way
+    bool parallel = opts.pyramid == 0 && !opts.forward && opts.layout == LAYOUT_PLANAR;
+    size_t large = batch_schedule(&batch, jobs, parallel, opts);
+
+    batch.carvers = malloc(sizeof(*batch.carvers)*jobs);
+    assert(batch.carvers != NULL);
+    for (int i = 0; i < jobs; ++i) batch.carvers[i] = seamcarver_create_with(opts);
+    batch.held = calloc(jobs, sizeof(*batch.held));
+    assert(batch.held != NULL);
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.freed, NULL);
+
+    size_t high_water = 0;
+    batch.begin = get_time();
+    if (large > 0) {
+        Options wide = opts;
+        wide.threads = jobs;
+        SeamCarver *ctx = seamcarver_create_with(wide);
+        Nob_String_Builder in = {0};
+        SeamCarver_Buffer out = {0};
+        for (size_t i = 0; i < large; ++i) {
+            // Nothing else runs next to a large image, so there is nothing to hold back for it
+            if (budget > 0 && batch.items[i].footprint > budget) {
+                fprintf(stderr, "WARNING: %s needs about %s, more than the budget of %s\n",
+                        batch.items[i].in_path, format_size(batch.items[i].footprint), format_size(budget));
+            }
+            batch_carve(&batch, &batch.items[i], ctx, &in, &out);
+        }
+        free(in.items);
+        free(out.items);
+        high_water = seamcarver_high_water(ctx);
+        seamcarver_destroy(ctx);
+    }
+    batch.next = large;
+    batch.admitted = large;
+    int workers = (size_t)jobs < batch.count - large ? jobs : (int)(batch.count - large);
+    if (workers > 0) {
+        Pool *pool = pool_create(workers);
+        pool_run(pool, batch_worker, &batch);
+        pool_destroy(pool);
+    }
+    double elapsed = get_time() - batch.begin;
+    if (log_path != NULL && !batch_write_log(&batch, log_path, jobs, large)) return false;
+
+    for (int i = 0; i < jobs; ++i) {
+        if (seamcarver_high_water(batch.carvers[i]) > high_water) high_water = seamcarver_high_water(batch.carvers[i]);
+        seamcarver_destroy(batch.carvers[i]);
+    }
+    free(batch.carvers);
+    free(batch.held);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.freed);
+
+    double *latencies = malloc(sizeof(*latencies)*batch.count);
+    assert(latencies != NULL);
+    size_t carved = 0;
+    size_t footprint = 0, measured = 0;
+    double worst = 0, wait = 0;
+    for (size_t i = 0; i < batch.count; ++i) {
+        Batch_Item *item = &batch.items[i];
+        wait += item->wait;
+        if (item->ok) {
+            latencies[carved++] = item->latency;
+            if (item->footprint > footprint) footprint = item->footprint;
+            if (item->measured > measured) measured = item->measured;
+            if ((double)item->measured/item->footprint > worst) worst = (double)item->measured/item->footprint;
+        } else {
+            fprintf(stderr, "ERROR: could not carve %s\n", item->in_path);
+        }
+        free(item->in_path);
+        free(item->out_path);
+    }
+    qsort(latencies, carved, sizeof(*latencies), compare_doubles);
+
+    printf("OK: carved %zu of %zu images into %s on %d jobs in %.3lfs, %.1lf images/sec\n",
+           carved, batch.count, out_dir, jobs, elapsed, carved/elapsed);
+    if (carved > 0) {
+        printf("    latency p50 %.3lfms, p99 %.3lfms, max %.3lfms\n", percentile(latencies, carved, 0.50)*1000,
+               percentile(latencies, carved, 0.99)*1000, latencies[carved - 1]*1000);
+    }
+    printf("    %zu large images alone on %d threads, %zu on %d workers largest first\n",
+           large, jobs, batch.count - large, workers);
+    printf("    largest arena %s\n", format_size(high_water));
+    printf("    largest footprint estimated %s, measured %s, at worst %.0lf%% of the estimate\n",
+           format_size(footprint), format_size(measured), worst*100);
+    if (budget > 0) {
+        printf("    budget %s, at most %s reserved at once, %.3lfs waited for memory\n",
+               format_size(budget), format_size(batch.reserved_peak), wait);
+    }
+    struct rusage usage = {0};
+    getrusage(RUSAGE_SELF, &usage);
+    // ru_maxrss is in KiB
+    printf("    peak rss %s\n", format_size(usage.ru_maxrss*1024.0));
+    bool ok = carved == batch.count;
+    free(latencies);
+    free(batch.items);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = nob_shift_args(&argc, &argv);
+
+    const char *file_path = NULL;
+    const char *out_file_path = NULL;
+    const char *simd_name = "auto";
+    bool bench = false;
+    Numbers target_widths = {0};
+    Numbers target_scales = {0};
+    int target_height = 0;
+    const char *index_read_path = NULL;
+    const char *index_write_path = NULL;
+    bool batch = false;
+    int jobs = 0;
+    const char *schedule_log_path = NULL;
+    size_t max_mem = 0;
+    Options opts = { .seams_per_pass = 1, .band = 2 };
+    while (argc > 0) {
+        const char *arg = nob_shift_args(&argc, &argv);
+        if (strcmp(arg, "--incremental") == 0) {
+            opts.incremental = true;
+        } else if (strcmp(arg, "--verify") == 0) {
+            opts.verify = true;
+        } else if (strcmp(arg, "--simd") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            simd_name = nob_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--threads") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            opts.threads = atoi(nob_shift_args(&argc, &argv));
+            if (opts.threads < 1) {
+                usage(program);
+                fprintf(stderr, "ERROR: --threads expects a positive number\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--dirs") == 0) {
+            opts.dirs = true;
+        } else if (strcmp(arg, "--rolling") == 0) {
+            opts.dirs = true;
+            opts.rolling = true;
+        } else if (strcmp(arg, "--seams-per-pass") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            opts.seams_per_pass = atoi(nob_shift_args(&argc, &argv));
+            if (opts.seams_per_pass < 1) {
+                usage(program);
+                fprintf(stderr, "ERROR: --seams-per-pass expects a positive number\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--lazy") == 0) {
+            opts.lazy = true;
+        } else if (strcmp(arg, "--layout") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            const char *layout = nob_shift_args(&argc, &argv);
+            if (strcmp(layout, "planar") == 0) {
+                opts.layout = LAYOUT_PLANAR;
+            } else if (strcmp(layout, "aos") == 0) {
+                opts.layout = LAYOUT_AOS;
+            } else {
+                usage(program);
+                fprintf(stderr, "ERROR: unknown layout %s\n", layout);
+                return 1;
+            }
+        } else if (strcmp(arg, "--lum") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            const char *lum = nob_shift_args(&argc, &argv);
+            if (strcmp(lum, "exact") == 0) {
+                opts.lum = LUM_EXACT;
+            } else if (strcmp(lum, "fixed") == 0) {
+                opts.lum = LUM_FIXED;
+            } else {
+                usage(program);
+                fprintf(stderr, "ERROR: unknown luminance mode %s\n", lum);
+                return 1;
+            }
+        } else if (strcmp(arg, "--energy") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            const char *energy = nob_shift_args(&argc, &argv);
+            size_t i = 0;
+            while (i < NOB_ARRAY_LEN(energy_names) && strcmp(energy, energy_names[i]) != 0) i += 1;
+            if (i == NOB_ARRAY_LEN(energy_names)) {
+                usage(program);
+                fprintf(stderr, "ERROR: unknown energy %s\n", energy);
+                return 1;
+            }
+            opts.energy = (Energy)i;
+        } else if (strcmp(arg, "--width") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            const char *list = nob_shift_args(&argc, &argv);
+            size_t first = target_widths.count;
+            bool ok = parse_numbers(list, &target_widths);
+            for (size_t i = first; ok && i < target_widths.count; ++i) {
+                double value = target_widths.items[i];
+                ok = value >= 1 && value <= INT32_MAX && value == (int)value;
+            }
+            if (!ok) {
+                usage(program);
+                fprintf(stderr, "ERROR: --width expects a comma separated list of positive numbers, got %s\n", list);
+                return 1;
+            }
+        } else if (strcmp(arg, "--scale") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            const char *list = nob_shift_args(&argc, &argv);
+            size_t first = target_scales.count;
+            bool ok = parse_numbers(list, &target_scales);
+            for (size_t i = first; ok && i < target_scales.count; ++i) {
+                ok = 0 < target_scales.items[i];
+            }
+            if (!ok) {
+                usage(program);
+                fprintf(stderr, "ERROR: --scale expects a comma separated list of positive numbers, got %s\n", list);
+                return 1;
+            }
+        } else if (strcmp(arg, "--height") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            target_height = atoi(nob_shift_args(&argc, &argv));
+            if (target_height < 1) {
+                usage(program);
+                fprintf(stderr, "ERROR: --height expects a positive number\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--write-index") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            index_write_path = nob_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--from-index") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            index_read_path = nob_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--forward") == 0) {
+            opts.forward = true;
+        } else if (strcmp(arg, "--pyramid") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            opts.pyramid = atoi(nob_shift_args(&argc, &argv));
+            if (opts.pyramid < 1 || opts.pyramid > PYRAMID_MAX_LEVELS) {
+                usage(program);
+                fprintf(stderr, "ERROR: --pyramid expects between 1 and %d levels\n", PYRAMID_MAX_LEVELS);
+                return 1;
+            }
+        } else if (strcmp(arg, "--band") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            opts.band = atoi(nob_shift_args(&argc, &argv));
+            if (opts.band < 1) {
+                usage(program);
+                fprintf(stderr, "ERROR: --band expects a positive number\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--scratch-dir") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            scratch_dir = nob_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--lum-on-demand") == 0) {
+            opts.lum_on_demand = true;
+        } else if (strcmp(arg, "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(arg, "--jobs") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            jobs = atoi(nob_shift_args(&argc, &argv));
+            if (jobs < 1) {
+                usage(program);
+                fprintf(stderr, "ERROR: --jobs expects a positive number\n");
+                return 1;
+            }
+        } else if (strcmp(arg, "--schedule-log") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            schedule_log_path = nob_shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--max-mem") == 0) {
+            if (argc <= 0) return missing_value(program, arg);
+            const char *size = nob_shift_args(&argc, &argv);
+            if (!parse_size(size, &max_mem)) {
+                usage(program);
+                fprintf(stderr, "ERROR: --max-mem expects a size like 512M or 8G, got %s\n", size);
+                return 1;
+            }
+        } else if (strcmp(arg, "--bench") == 0) {
+            bench = true;
+        } else if (strncmp(arg, "--", 2) == 0) {
+            usage(program);
+            fprintf(stderr, "ERROR: unknown option %s\n", arg);
+            return 1;
+        } else if (file_path == NULL) {
+            file_path = arg;
+        } else if (out_file_path == NULL) {
+            out_file_path = arg;
+        } else {
+            usage(program);
+            fprintf(stderr, "ERROR: unexpected argument %s\n", arg);
+            return 1;
+        }
+    }
+
+    if (file_path == NULL) {
+        usage(program);
+        fprintf(stderr, "ERROR: no input file is provided\n");
+        return 1;
+    }
+
+    if (out_file_path == NULL && !bench) {
+        usage(program);
+        fprintf(stderr, "ERROR: no output file is provided\n");
+        return 1;
+    }
+
+    if (!simd_select(simd_name)) {
+        usage(program);
+        fprintf(stderr, "ERROR: SIMD kernels %s are not available on this machine\n", simd_name);
+        return 1;
+    }
+
+    if (opts.verify && !opts.incremental) {
+        usage(program);
+        fprintf(stderr, "ERROR: --verify only makes sense with --incremental\n");
+        return 1;
+    }
+
+    if (opts.incremental && opts.dirs) {
+        usage(program);
+        fprintf(stderr, "ERROR: --incremental needs the whole cumulative energy and cannot be combined with --dirs or --rolling\n");
+        return 1;
+    }
+
+    if (opts.incremental && opts.seams_per_pass > 1) {
+        usage(program);
+        fprintf(stderr, "ERROR: --incremental only supports one seam per pass\n");
+        return 1;
+    }
+
+    if (opts.layout == LAYOUT_AOS && (opts.incremental || opts.dirs || opts.lazy || opts.threads > 1)) {
+        usage(program);
+        fprintf(stderr, "ERROR: --layout aos only supports --seams-per-pass\n");
+        return 1;
+    }
+
+    if (opts.pyramid > 0 && (opts.incremental || opts.dirs || opts.seams_per_pass > 1 || opts.threads > 1 || opts.layout == LAYOUT_AOS)) {
+        usage(program);
+        fprintf(stderr, "ERROR: --pyramid runs its own banded search and cannot be combined with the other dp modes\n");
+        return 1;
+    }
+
+    if (opts.forward && (opts.incremental || opts.dirs || opts.seams_per_pass > 1 || opts.threads > 1 ||
+                         opts.pyramid > 0 || opts.layout == LAYOUT_AOS || opts.lum_on_demand)) {
+        usage(program);
+        fprintf(stderr, "ERROR: --forward computes its own dp from the lum plane and cannot be combined with the other dp modes\n");
+        return 1;
+    }
+
+    if (opts.forward && opts.energy != ENERGY_SOBEL) {
+        usage(program);
+        fprintf(stderr, "ERROR: --forward is an energy of its own and cannot be combined with --energy\n");
+        return 1;
+    }
+
+    if (opts.energy == ENERGY_HALF && (opts.layout == LAYOUT_AOS || opts.lum_on_demand)) {
+        usage(program);
+        fprintf(stderr, "ERROR: --energy half needs the planar lum plane\n");
+        return 1;
+    }
+
+    if (opts.layout == LAYOUT_AOS && opts.lum_on_demand) {
+        usage(program);
+        fprintf(stderr, "ERROR: --lum-on-demand only works with the planar layout\n");
+        return 1;
+    }
+
+    if (max_mem > 0 && !batch) {
+        usage(program);
+        fprintf(stderr, "ERROR: --max-mem only limits the workers of --batch\n");
+        return 1;
+    }
+
+    if (batch) {
+        if (bench || target_widths.count > 0 || target_scales.count > 1 || target_height != 0 ||
+            index_read_path != NULL || index_write_path != NULL || scratch_dir != NULL || opts.threads > 1) {
+            usage(program);
+            fprintf(stderr, "ERROR: --batch carves every image to a single --scale on --jobs workers, which also pick the threads of every image\n");
+            return 1;
+        }
+        double scale = target_scales.count > 0 ? target_scales.items[0] : 0;
+        if (jobs == 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        return batch_run(file_path, out_file_path, scale, jobs, max_mem, opts, schedule_log_path) ? 0 : 1;
+    }
+
+    if (index_read_path != NULL && index_write_path != NULL) {
+        usage(program);
+        fprintf(stderr, "ERROR: --write-index and --from-index cannot be combined\n");
+        return 1;
+    }
+
+    if ((index_read_path != NULL || index_write_path != NULL) && (target_height != 0 || opts.layout == LAYOUT_AOS)) {
+        usage(program);
+        fprintf(stderr, "ERROR: the retarget index only covers the width of the planar layout\n");
+        return 1;
+    }
+
+    int width_, height_;
+    uint32_t *pixels_ = (uint32_t*)stbi_load(file_path, &width_, &height_, NULL, 4);
+    if (pixels_ == NULL) {
+        fprintf(stderr, "ERROR: could not read %s\n", file_path);
+        return 1;
+    }
+    if (scratch_dir != NULL) {
+        // stb_image can only decode into RAM, but the carving does not have to keep it there
+        size_t size = sizeof(uint32_t)*width_*height_;
+        uint32_t *pixels = storage_alloc(size);
+        memcpy(pixels, pixels_, size);
+        stbi_image_free(pixels_);
+        pixels_ = pixels;
+    }
+    Img img = {
+        .pixels = pixels_,
+        .width = width_,
+        .height = height_,
+        .stride = width_,
+    };
+
+    int seams_to_remove = img.width * 2 / 3;
+
+    // Without a target size the image loses two thirds of its width, with one the dimension
+    // that is not given stays as it is
+    Widths widths = {0};
+    for (size_t i = 0; i < target_widths.count; ++i) nob_da_append(&widths, (int)target_widths.items[i]);
+    for (size_t i = 0; i < target_scales.count; ++i) {
+        int width = (int)(img.width*target_scales.items[i] + 0.5);
+        nob_da_append(&widths, width > 0 ? width : 1);
+    }
+    if (widths.count == 0) nob_da_append(&widths, target_height == 0 ? img.width - seams_to_remove : img.width);
+    if (target_height == 0) target_height = img.height;
+
+    qsort(widths.items, widths.count, sizeof(*widths.items), compare_widths_desc);
+    size_t unique = 0;
+    for (size_t i = 0; i < widths.count; ++i) {
+        if (unique == 0 || widths.items[unique - 1] != widths.items[i]) widths.items[unique++] = widths.items[i];
+    }
+    widths.count = unique;
+
+    if ((widths.count > 1 || index_read_path != NULL || index_write_path != NULL) && widths.items[0] > img.width) {
+        fprintf(stderr, "ERROR: only a single --width can enlarge the image\n");
+        return 1;
+    }
+    // Only a dimension that grows goes through the index map, shrinking works at any size
+    if ((widths.items[0] > img.width && widths.items[0] > IMG_LAZY_MAX_WIDTH) ||
+        (target_height > img.height && target_height > IMG_LAZY_MAX_WIDTH)) {
+        fprintf(stderr, "ERROR: the image can be enlarged up to %dx%d\n", IMG_LAZY_MAX_WIDTH, IMG_LAZY_MAX_WIDTH);
+        return 1;
+    }
+
+    if (bench) {
+        bench_lum(img);
+        Carver c = carver_create(img, (Options) { .seams_per_pass = 1 });
+        bench_sobel(img, c.lum, c.grad);
+        bench_dp(c.lum, c.grad, opts.threads > 0 ? opts.threads : (int)sysconf(_SC_NPROCESSORS_ONLN));
+        carver_destroy(&c);
+        bench_transpose(img);
+        bench_pyramid(img, seams_to_remove/4 > 0 ? seams_to_remove/4 : 1);
+        bench_layouts(img, seams_to_remove/4 > 0 ? seams_to_remove/4 : 1);
+        return 0;
+    }
+
+    if (index_read_path != NULL || index_write_path != NULL) {
+        if (index_write_path != NULL && img.width > IMG_LAZY_MAX_WIDTH) {
+            fprintf(stderr, "ERROR: %s is too wide for a retarget index\n", file_path);
+            return 1;
+        }
+        return retarget_widths(img, widths.items, widths.count, opts, index_read_path, index_write_path, out_file_path) ? 0 : 1;
+    }
+
+    if (widths.count > 1) return carve_widths(img, widths.items, widths.count, target_height, opts, out_file_path) ? 0 : 1;
+
+    if (!carve(&img, widths.items[0], target_height, opts)) return 1;
+
+    if (!stbi_write_png(out_file_path, img.width, img.height, 4, img.pixels, img.stride*sizeof(uint32_t))) {
+        fprintf(stderr, "ERROR: could not save file %s\n", out_file_path);
+        return 1;
+    }
+    printf("OK: generated %s\n", out_file_path);
+
+    return 0;
+}
+
+#endif // SEAMCARVE_NO_MAIN
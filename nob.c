@@ -18,6 +18,8 @@ void cc(Nob_Cmd *cmd)
     nob_cmd_append(cmd, "cc");
     nob_cmd_append(cmd, "-Wall", "-Wextra", "-ggdb");
     nob_cmd_append(cmd, "-O3");
+    // The SIMD kernels are kept bit identical to the scalar ones, which a contracted FMA would break
+    nob_cmd_append(cmd, "-ffp-contract=off");
 }
 
 bool rebuild_stb_if_needed(Nob_Cmd *cmd, const char *implementation, const char *input, const char *output)
@@ -58,7 +60,18 @@ int main(int argc, char **argv)
     nob_cmd_append(&cmd, main_input);
     nob_cmd_append(&cmd, "./build/stb_image.o");
     nob_cmd_append(&cmd, "./build/stb_image_write.o");
-    nob_cmd_append(&cmd, "-lm");
+    nob_cmd_append(&cmd, "-lm", "-lpthread");
+    if (!nob_cmd_run_sync(cmd)) return 1;
+
+    // The same engine without main() for embedding, see seamcarve.h
+    cmd.count = 0;
+    cc(&cmd);
+    nob_cmd_append(&cmd, "-DSEAMCARVE_NO_MAIN");
+    nob_cmd_append(&cmd, "-c", "-o", "./build/seamcarve.o", main_input);
+    if (!nob_cmd_run_sync(cmd)) return 1;
+    cmd.count = 0;
+    // stb is compiled into seamcarve.o with static linkage, see main.c
+    nob_cmd_append(&cmd, "ar", "rcs", "./build/libseamcarve.a", "./build/seamcarve.o");
     if (!nob_cmd_run_sync(cmd)) return 1;
 
     cmd.count = 0;
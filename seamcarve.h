@@ -0,0 +1,59 @@
+#ifndef SEAMCARVE_H_
+#define SEAMCARVE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The carving engine of main.c as a library. nob builds it into build/libseamcarve.a by
+// compiling main.c with SEAMCARVE_NO_MAIN. The library brings its own stb_image and
+// stb_image_write with static linkage, so it exports nothing but the functions below.
+
+// A carving context. Every buffer a carve needs comes out of an arena owned by the context,
+// which is kept at the size of the biggest carve so far. Once the context has seen its
+// biggest image, carving does not allocate at all. A context must not be shared by threads
+// carving at the same time, but every thread can have one of its own.
+typedef struct SeamCarver SeamCarver;
+
+SeamCarver *seamcarver_create(void);
+void seamcarver_destroy(SeamCarver *ctx);
+
+// Carves the width x height RGBA image at in_pixels, whose rows are stride pixels apart, to
+// target_width columns. A target_width above width duplicates the lowest energy seams. The
+// result is written to out, whose rows are target_width pixels apart. in_pixels is not
+// modified. Returns false if target_width is out of range.
+bool seamcarver_carve(SeamCarver *ctx, const uint32_t *in_pixels, int width, int height, int stride,
+                      int target_width, uint32_t *out);
+
+// The most memory a single carve of the context has needed so far, in bytes
+size_t seamcarver_high_water(const SeamCarver *ctx);
+
+// A growable buffer of encoded bytes in the layout of a nob dynamic array. It is owned by the
+// caller and grown with realloc, so it can start out empty or be reused between calls.
+typedef struct {
+    unsigned char *items;
+    size_t count;
+    size_t capacity;
+} SeamCarver_Buffer;
+
+typedef enum {
+    SEAMCARVER_PNG,
+    SEAMCARVER_JPG,
+} SeamCarver_Format;
+
+// The dimensions of an encoded image in any format stb_image reads, without decoding it
+bool seamcarver_info(const void *data, size_t size, int *width, int *height);
+
+// Decodes the image in data, carves it to target_width columns in the decoded pixels and
+// appends it encoded in the given format to out. quality only applies to SEAMCARVER_JPG.
+// Returns false if the image cannot be decoded or target_width is out of range.
+bool seamcarver_carve_encoded(SeamCarver *ctx, const void *data, size_t size, int target_width,
+                              SeamCarver_Format format, int quality, SeamCarver_Buffer *out);
+
+// An estimate of the most memory seamcarver_carve_encoded needs at once to carve a width x
+// height image of file_size encoded bytes to target_width, taking what seamcarver_info
+// reports. It covers the encoded input, the decoded pixels, the carve and the encoded output,
+// so a service can hold jobs back until they fit into its memory.
+size_t seamcarver_footprint(int width, int height, int target_width, size_t file_size);
+
+#endif // SEAMCARVE_H_